@@ -21,7 +21,7 @@ variable *used_regs[] = {NULL, NULL, NULL, NULL, NULL};
 const int reg_count = sizeof(used_regs) / sizeof(used_regs[0]);
 int scope_level;
 
-void gen_code(tree *t);
+void gen_code(tree t);
 
 int whiles;
 int call_returns;
@@ -166,19 +166,19 @@ int get_size(type t) {
     }
 }
 
-type gen_expression(tree *t, char *output1, int expected_size) {
+type gen_expression(tree t, char *output1, int expected_size) {
     parser_debug("gen_expression()\n");
     type output = {NULL, -1, -1};
     output.value = output1;
-    if(t->type == TREETYPE_OPERATOR) {
-        switch(t->data.tok->type) {
+    if(tree_type(t) == TREETYPE_OPERATOR) {
+        switch(tree_data(t).tok->type) {
             case TOK_POINTER: {
-                type out = gen_expression(t->left, "%oo", -1);
+                type out = gen_expression(tree_left(t), "%oo", -1);
                 if(out.pointers > 0) {
                     output.pointers = out.pointers - 1;
                     output.base_size = out.base_size;
                 } else {
-                    printf("Warning: Dereferencing a non-pointer type.\n", get_string_from_toktype(t->data.tok->type));
+                    printf("Warning: Dereferencing a non-pointer type.\n", get_string_from_toktype(tree_data(t).tok->type));
                 }
                 if(expected_size == 1) {
                     print("mov8 [%s] %s\n", out.value, output1);
@@ -188,29 +188,29 @@ type gen_expression(tree *t, char *output1, int expected_size) {
                 break;
             }
             default: {
-                printf("Error: operator '%s' is unsupported in this version of the compiler.\n", get_string_from_toktype(t->data.tok->type));
+                printf("Error: operator '%s' is unsupported in this version of the compiler.\n", get_string_from_toktype(tree_data(t).tok->type));
                 exit(1);
             }
         }
-    } else if(t->type == TREETYPE_VARIABLE) {
-        variable *var = t->data.var;
+    } else if(tree_type(t) == TREETYPE_VARIABLE) {
+        variable *var = tree_data(t).var;
         output.base_size = get_variable_size_nopointer(var);
         output.value = variable_to_reg(var);
         output.pointers = var->pointers;
-    } else if(t->type == TREETYPE_INTEGER) {
-        output.value = format("%d", t->data.int_value);
+    } else if(tree_type(t) == TREETYPE_INTEGER) {
+        output.value = format("%d", tree_data(t).int_value);
         output.pointers = 0;
         output.base_size = 2;
-    } else if(t->type == TREETYPE_CHAR) {
-        output.value = format("%d", t->data.int_value);
+    } else if(tree_type(t) == TREETYPE_CHAR) {
+        output.value = format("%d", tree_data(t).int_value);
         output.pointers = 0;
         output.base_size = 1;
-    } else if(t->type == TREETYPE_STRING) {
-        output.value = global_add_string(t->data.string_value);
+    } else if(tree_type(t) == TREETYPE_STRING) {
+        output.value = global_add_string(tree_data(t).string_value);
         output.pointers = 1;
         output.base_size = 1;
     } else {
-        printf("Error: weird expression: %d\n", t->type);
+        printf("Error: weird expression: %d\n", tree_type(t));
         exit(1);
     }
     if(expected_size != -1 && get_size(output) > expected_size) {
@@ -220,12 +220,12 @@ type gen_expression(tree *t, char *output1, int expected_size) {
     return output;
 }
 
-void gen_assign(tree *t) {
+void gen_assign(tree t) {
     parser_debug("gen_assign()\n");
-    variable *var = t->left->data.var;
+    variable *var = tree_data(tree_left(t)).var;
     if(var->is_register) {
         char *output = variable_to_reg(var);
-        type exp = gen_expression(t->right, output, get_variable_size(var));
+        type exp = gen_expression(tree_right(t), output, get_variable_size(var));
         if(strcmp(exp.value, output) != 0) {
             if(get_variable_size(var) == 1) {
                 print("mov8 %s %s\n", exp.value, output);
@@ -242,9 +242,9 @@ void gen_assign(tree *t) {
     }
 }
 
-void gen_define(tree *t) {
+void gen_define(tree t) {
     parser_debug("gen_define()\n");
-    variable *var = t->left->data.var;
+    variable *var = tree_data(tree_left(t)).var;
     if(var->is_register) {
         use_register(var);
     } else if(var->is_argument) {
@@ -254,27 +254,27 @@ void gen_define(tree *t) {
         printf("Error: There is currently no support for non-register variables.\n");
         exit(1);
     }
-    if(t->right != NULL) {
-        gen_assign(t->right);
+    if(tree_right(t) != 0) {
+        gen_assign(tree_right(t));
     }
 }
 
-void gen_func_call(tree *t) {
+void gen_func_call(tree t) {
     parser_debug("gen_func_call()\n");
-    variable *var = t->left->data.var;
+    variable *var = tree_data(tree_left(t)).var;
     varlist *args = var->arguments;
     push_used_registers();
     print("push call_return_%d\n", call_returns);
-    tree *arg = t->right;
+    tree arg = tree_right(t);
     int i = 0;
-    while(arg != NULL) {
+    while(arg != 0) {
         if(i >= args->length) {
             printf("Error: too many arguments supplied for function \"%s\"", var->name);
             exit(1);
         }
-        type exp = gen_expression(arg->left, "%oo", get_variable_size(args->list[i]));
+        type exp = gen_expression(tree_left(arg), "%oo", get_variable_size(args->items[i]));
         print("push %s\n", exp.value);
-        arg = arg->right;
+        arg = tree_right(arg);
         i++;
     }
     print("mov func_%s %%ip\n", var->name);
@@ -282,144 +282,171 @@ void gen_func_call(tree *t) {
     pop_used_registers();
     int arg_size = 0;
     for(i = args->length - 1; i >= 0; i--) {
-        arg_size += get_variable_size(args->list[i]);
+        arg_size += get_variable_size(args->items[i]);
     }
     print("sub %%sp %d\n", arg_size + 2);
     print("mov %%oo %%sp\n");
     call_returns++;
 }
 
-void gen_while(tree *t) {
+void gen_while(tree t) {
     parser_debug("gen_while()\n");
-    if(t->left->type == TREETYPE_INTEGER) {
-        if(t->left->data.int_value != 0) {
+    if(tree_type(tree_left(t)) == TREETYPE_INTEGER) {
+        if(tree_data(tree_left(t)).int_value != 0) {
             print("while_%d:\n", whiles);
             print("mov while_%d %%ip\n", whiles);
             whiles++;
         }
     } else {
         print("while_%d:\n", whiles);
-        type exp = gen_expression(t->left, "%oo", 1);
+        type exp = gen_expression(tree_left(t), "%oo", 1);
         print("if %s while_%d_end\n", exp.value, whiles);
-        gen_code(t->right);
+        gen_code(tree_right(t));
         print("mov while_%d %%ip\n", whiles);
         print("while_%d_end:\n", whiles);
         whiles++;
     }
 }
 
-void _gen_asm(tree *t) {
-    switch(t->left->type) {
+void _gen_asm(tree t) {
+    switch(tree_type(tree_left(t))) {
         case TREETYPE_INTEGER: {
-            print_noindent("%d", t->left->data.int_value);
+            print_noindent("%d", tree_data(tree_left(t)).int_value);
             break;
         }
         case TREETYPE_CHAR: {
-            print_noindent("%d", t->left->data.int_value);
+            print_noindent("%d", tree_data(tree_left(t)).int_value);
             break;
         }
         case TREETYPE_IDENTIFIER: {
-            print_noindent("%s", t->left->data.string_value);
+            print_noindent("%s", tree_data(tree_left(t)).string_value);
             break;
         }
         case TREETYPE_VARIABLE: {
-            char *reg = variable_to_reg(t->left->data.var);
+            variable *var = tree_data(tree_left(t)).var;
+            // a function is its label
+            if(var->is_function) {
+                print_noindent("func_%s", var->name);
+                break;
+            }
+            char *reg = variable_to_reg(var);
             print_noindent("%s", reg);
             break;
         }
     }
-    if(t->right != NULL) {
-        if(strcmp(t->left->data.string_value, "%") != 0) {
+    if(tree_right(t) != 0) {
+        if(strcmp(tree_data(tree_left(t)).string_value, "%") != 0) {
             print_noindent(" ");
         }
-        _gen_asm(t->right);
+        _gen_asm(tree_right(t));
     }
 }
 
-void gen_asm(tree *t) {
+void gen_asm(tree t) {
     parser_debug("gen_asm()\n");
     print("");
     _gen_asm(t);
     print_noindent("\n");
 }
 
-void gen_increment(tree *t) {
+void gen_increment(tree t) {
     parser_debug("gen_increment()\n");
-    variable *var = t->left->data.var;
+    variable *var = tree_data(tree_left(t)).var;
     char *reg = variable_to_reg(var);
     print("add %s 1\n", reg);
     print("mov %%oo %s\n", reg);
 }
 
-void gen_decrement(tree *t) {
+void gen_decrement(tree t) {
     parser_debug("gen_decrement()\n");
-    variable *var = t->left->data.var;
+    variable *var = tree_data(tree_left(t)).var;
     char *reg = variable_to_reg(var);
     print("sub %s 1\n", reg);
     print("mov %%oo %s\n", reg);
 }
 
-void gen_statement_list(tree *t) {
-    if(t != NULL) {
+void gen_statement_list(tree t) {
+    while(t != 0) {
         parser_debug("gen_statement_list()\n");
-        gen_code(t->left);
-        gen_statement_list(t->right);
+        gen_code(tree_left(t));
+        t = tree_right(t);
     }
 }
 
-void gen_block(tree *t) {
+// blocks directly inside blocks are walked with a stack of what's left of
+// each one's statements, so deep nesting doesn't recurse
+void gen_block(tree t) {
     parser_debug("gen_block()\n");
+    tree_list rest;
+    tree_list_init(&rest, NULL);
     indent_level++;
     scope_level++;
-    gen_statement_list(t);
-    clear_used_registers_scope();
-    scope_level--;
-    indent_level--;
+    tree_list_add(&rest, t);
+    while(rest.length > 0) {
+        tree list = rest.items[rest.length - 1];
+        if(list == 0) {
+            clear_used_registers_scope();
+            scope_level--;
+            indent_level--;
+            rest.length--;
+            continue;
+        }
+        rest.items[rest.length - 1] = tree_right(list);
+        tree statement = tree_left(list);
+        if(statement != 0 && tree_type(statement) == TREETYPE_BLOCK) {
+            indent_level++;
+            scope_level++;
+            tree_list_add(&rest, statement);
+        } else {
+            gen_code(statement);
+        }
+    }
+    tree_list_end(&rest);
 }
 
-void gen_code(tree *t) {
-    if(t != NULL) {
+void gen_code(tree t) {
+    if(t != 0) {
         parser_debug("gen_code()\n");
-        if(t->type == TREETYPE_DEFINE) {
+        if(tree_type(t) == TREETYPE_DEFINE) {
             gen_define(t);
-        } else if(t->type == TREETYPE_ASSIGN) {
+        } else if(tree_type(t) == TREETYPE_ASSIGN) {
             gen_assign(t);
-        } else if(t->type == TREETYPE_FUNC_CALL) {
+        } else if(tree_type(t) == TREETYPE_FUNC_CALL) {
             gen_func_call(t);
-        } else if(t->type == TREETYPE_WHILE) {
+        } else if(tree_type(t) == TREETYPE_WHILE) {
             gen_while(t);
-        } else if(t->type == TREETYPE_ASM) {
+        } else if(tree_type(t) == TREETYPE_ASM) {
             gen_asm(t);
-        } else if(t->type == TREETYPE_OPERATOR) {
-            if(t->data.tok->type == TOK_INCREMENT) {
+        } else if(tree_type(t) == TREETYPE_OPERATOR) {
+            if(tree_data(t).tok->type == TOK_INCREMENT) {
                 gen_increment(t);
-            } else if(t->data.tok->type == TOK_DECREMENT) {
+            } else if(tree_data(t).tok->type == TOK_DECREMENT) {
                 gen_decrement(t);
             }
-        } else if(t->type == TREETYPE_BLOCK) {
+        } else if(tree_type(t) == TREETYPE_BLOCK) {
             gen_block(t);
-        } else if(t->type == TREETYPE_STATEMENT_LIST) {
+        } else if(tree_type(t) == TREETYPE_STATEMENT_LIST) {
             gen_statement_list(t);
         }
     }
 }
 
-void gen_function(tree *t) {
+void gen_function(tree t) {
     parser_debug("gen_function()\n");
     scope_level++;
-    variable *var = t->left->data.var;
+    variable *var = tree_data(tree_left(t)).var;
     print("func_%s:\n", var->name);
     varlist *arguments = var->arguments;
     int i;
     int arg_size = 0;
     int id = 0;
     for(i = arguments->length - 1; i >= 0; i--) {
-        int size = get_variable_size(arguments->list[i]);
+        int size = get_variable_size(arguments->items[i]);
         id -= size;
-        arguments->list[i]->address = id;
+        arguments->items[i]->address = id;
         arg_size += size;
     }
-    gen_code(t->right);
+    gen_code(tree_right(t));
     print("return_%s:\n", var->name);
     if(strcmp(var->name, "main") == 0) {
         print("end\n");
@@ -441,18 +468,18 @@ void gen_function(tree *t) {
     scope_level--;
 }
 
-void gen_declaration(tree *t) {
+void gen_declaration(tree t) {
     parser_debug("gen_declaration()\n");
-    if(t->type == TREETYPE_FUNCTION_DEFINITION) {
+    if(tree_type(t) == TREETYPE_FUNCTION_DEFINITION) {
         gen_function(t);
     }
 }
 
-void gen_declaration_list(tree *t) {
-    if(t != NULL) {
+void gen_declaration_list(tree t) {
+    while(t != 0) {
         parser_debug("gen_declaration_list()\n");
-        gen_declaration(t->left);
-        gen_declaration_list(t->right);
+        gen_declaration(tree_left(t));
+        t = tree_right(t);
     }
 }
 
@@ -481,7 +508,7 @@ void gen_end() {
 
 // AST should be a valid program tree since it's generated by
 // the parser, so there's no need to check for errors in it 
-void generate(FILE *output, tree *AST) {
+void generate(FILE *output, tree AST) {
     #ifdef linux
         backtrace_start = get_backtrace_level() + 1;
     #endif
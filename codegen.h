@@ -5,6 +5,6 @@
 
 #include "parser.h"
 
-void generate(FILE *output, tree *AST);
+void generate(FILE *output, tree AST);
 
 #endif
@@ -1,61 +1,186 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <memory.h>
 
 #include "datastructs.h"
 #include "tokenizer.h"
 
-void string_builder_init(string_builder *builder) {
-    builder->length = 0;
-    builder->buffer_length = 16;
-    builder->buffer = malloc(16);
+void region_init(region *r) {
+    r->first = NULL;
+    r->current = NULL;
 }
 
-void string_builder_end(string_builder *builder) {
-    free(builder->buffer);
+void region_end(region *r) {
+    region_block *block = r->first;
+    while(block != NULL) {
+        region_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    r->first = NULL;
+    r->current = NULL;
+}
+
+void region_clear(region *r) {
+    r->current = r->first;
+    if(r->current != NULL) {
+        r->current->used = 0;
+    }
 }
 
-void string_builder_add(string_builder *builder, char c) {
-    if(builder->length == builder->buffer_length) {
-        #if STRING_GROW_EXPONENTIAL
-            builder->buffer_length <<= 1;
-        #else
-            builder->buffer_length += 16;
-        #endif
-        builder->buffer = realloc(builder->buffer, builder->buffer_length);
+// the data of a block follows its header, rounded up so allocations are 8
+// byte aligned
+#define REGION_HEADER_SIZE ((sizeof(region_block) + 7) & ~7)
+
+void *region_alloc(region *r, int size) {
+    size = (size + 7) & ~7;
+    region_block *block = r->current;
+    while(block == NULL || block->used + size > block->size) {
+        if(block != NULL && block->next != NULL && block->next->size >= size) {
+            // a block left over from before the region was cleared
+            block = block->next;
+            block->used = 0;
+            continue;
+        }
+        int block_size = size > REGION_BLOCK_SIZE ? size : REGION_BLOCK_SIZE;
+        region_block *new = malloc(REGION_HEADER_SIZE + block_size);
+        new->size = block_size;
+        new->used = 0;
+        if(block == NULL) {
+            new->next = r->first;
+            r->first = new;
+        } else {
+            new->next = block->next;
+            block->next = new;
+        }
+        block = new;
     }
-    builder->buffer[builder->length] = c;
-    builder->length++;
+    r->current = block;
+    void *out = (char *)block + REGION_HEADER_SIZE + block->used;
+    block->used += size;
+    return out;
 }
 
+char *region_strdup(region *r, char *string) {
+    int length = strlen(string) + 1;
+    char *out = region_alloc(r, length);
+    memcpy(out, string, length);
+    return out;
+}
+
+DEFINE_VECTOR(string_builder, char)
+
 char *string_builder_get(string_builder *builder) {
-    if(builder->length == builder->buffer_length) {
-        #if STRING_GROW_EXPONENTIAL
-            builder->buffer_length <<= 1;
-        #else
-            builder->buffer_length += 16;
-        #endif
-        builder->buffer = realloc(builder->buffer, builder->buffer_length);
+    if(builder->length == builder->capacity) {
+        string_builder_reserve(builder, builder->capacity * 2);
     }
-    builder->buffer[builder->length] = '\0';
-    return builder->buffer;
+    builder->items[builder->length] = '\0';
+    return builder->items;
 }
 
 char string_builder_get_char(string_builder *builder, int offset) {
-    return builder->buffer[offset];
+    return builder->items[offset];
 }
 
 void string_builder_clear(string_builder *builder) {
+    builder->length = 0;
     #if STRING_BUILDER_DEALLOC_ON_CLEAR
-        builder->buffer = realloc(builder->buffer, 16);
+        string_builder_shrink(builder);
     #endif
-    builder->length = 0;
 }
 
-variable *create_variable() {
-    variable *out = malloc(sizeof(variable));
+typedef struct interned {
+    unsigned int hash;
+    int length;
+    char string[];
+} interned;
+
+// open addressing, the size is always a power of 2 and at most half full
+interned **intern_table;
+int intern_table_size;
+int intern_table_used;
+
+void intern_init() {
+    intern_table_size = INTERN_TABLE_START_SIZE;
+    intern_table_used = 0;
+    intern_table = calloc(intern_table_size, sizeof(interned *));
+}
+
+void intern_end() {
+    int i;
+    for(i = 0; i < intern_table_size; i++) {
+        free(intern_table[i]);
+    }
+    free(intern_table);
+    intern_table = NULL;
+}
+
+// FNV-1a
+unsigned int intern_hash(char *string, int length) {
+    unsigned int hash = 2166136261u;
+    int i;
+    for(i = 0; i < length; i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+unsigned int interned_hash(char *string) {
+    return ((interned *)(string - offsetof(interned, string)))->hash;
+}
+
+void intern_grow() {
+    interned **old = intern_table;
+    int old_size = intern_table_size;
+    int i;
+    intern_table_size <<= 1;
+    intern_table = calloc(intern_table_size, sizeof(interned *));
+    for(i = 0; i < old_size; i++) {
+        if(old[i] != NULL) {
+            int j = old[i]->hash & (intern_table_size - 1);
+            while(intern_table[j] != NULL) {
+                j = (j + 1) & (intern_table_size - 1);
+            }
+            intern_table[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+char *intern_string(char *string, int length) {
+    return intern_string_hashed(string, length, intern_hash(string, length));
+}
+
+// for when the hash was already worked out, e.g. by a lexer thread
+char *intern_string_hashed(char *string, int length, unsigned int hash) {
+    int i = hash & (intern_table_size - 1);
+    while(intern_table[i] != NULL) {
+        interned *entry = intern_table[i];
+        if(entry->hash == hash && entry->length == length && memcmp(entry->string, string, length) == 0) {
+            return entry->string;
+        }
+        i = (i + 1) & (intern_table_size - 1);
+    }
+    interned *entry = malloc(sizeof(interned) + length + 1);
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->string, string, length);
+    entry->string[length] = '\0';
+    intern_table[i] = entry;
+    intern_table_used++;
+    if(intern_table_used * 2 > intern_table_size) {
+        intern_grow();
+    }
+    return entry->string;
+}
+
+variable *create_variable(region *r) {
+    variable *out = region_alloc(r, sizeof(variable));
     memset(out, 0, sizeof(variable));
     out->address = -1;
+    out->lazy_body = -1;
     return out;
 }
 
@@ -128,210 +253,158 @@ void print_variable(variable *var) {
     printf("}\n");
 }
 
-varlist *create_varlist() {
-    varlist *list = malloc(sizeof(varlist));
-    list->bytes_size = -1;
-    list->length = 0;
-    list->buffer_length = 16;
-    list->list = malloc(16 * sizeof(variable *));
-    return list;
-}
-
-void delete_varlist(varlist *list) {
-    free(list->list);
-    free(list);
-}
+DEFINE_VECTOR(varlist, variable *)
 
-void varlist_add(varlist *list, variable *v) {
-    if(list->length == list->buffer_length) {
-        #if VARLIST_GROW_EXPONENTIAL
-            list->buffer_length <<= 1;
-        #else
-            list->buffer_length += 16;
-        #endif
-        list->list = realloc(list->list, list->buffer_length * sizeof(variable *));
-    }
-    list->list[list->length] = v;
-    list->length++;
+varlist *create_varlist(region *r) {
+    varlist *list = region_alloc(r, sizeof(varlist));
+    varlist_init(list, r);
+    return list;
 }
 
 variable *varlist_get(varlist *list, int id) {
-    return list->list[id];
+    return list->items[id];
 }
 
 void print_varlist(varlist *list) {
     int i;
     printf("VARIABLE LIST:\n");
     for(i = 0; i < list->length; i++) {
-        print_variable(list->list[i]);
+        print_variable(list->items[i]);
     }
 }
 
-toklist *create_toklist() {
-    toklist *list = malloc(sizeof(toklist));
-    list->length = 0;
-    list->buffer_length = 16;
-    list->list = malloc(16 * sizeof(token *));
-    return list;
-}
-
-void delete_toklist(toklist *list) {
-    free(list->list);
-    free(list);
+scope_table *create_scope_table() {
+    scope_table *table = malloc(sizeof(scope_table));
+    table->size = SCOPE_TABLE_START_SIZE;
+    table->used = 0;
+    table->entries = calloc(table->size, sizeof(scope_entry *));
+    table->log = NULL;
+    table->log_length = 0;
+    table->log_capacity = 0;
+    table->scopes = NULL;
+    table->depth = 0;
+    table->scopes_capacity = 0;
+    return table;
 }
 
-void toklist_add(toklist *list, token *v) {
-    if(list->length == list->buffer_length) {
-        #if toklist_GROW_EXPONENTIAL
-            list->buffer_length <<= 1;
-        #else
-            list->buffer_length += 16;
-        #endif
-        list->list = realloc(list->list, list->buffer_length * sizeof(token *));
+void delete_scope_table(scope_table *table) {
+    int i;
+    for(i = 0; i < table->size; i++) {
+        free(table->entries[i]);
     }
-    list->list[list->length] = v;
-    list->length++;
-}
-
-token *toklist_get(toklist *list, int id) {
-    return list->list[id];
-}
-
-opstack_link *create_opstack_link(void *value, int prefix_postfix) {
-    opstack_link *link = malloc(sizeof(opstack_link));
-    link->value = value;
-    link->prefix_postfix = prefix_postfix;
-    link->last = NULL;
-    link->next = NULL;
-    return link;
+    free(table->entries);
+    free(table->log);
+    free(table->scopes);
+    free(table);
+}
+
+// the entry for name, NULL if it's never been declared, or the empty slot
+// it would go in
+scope_entry **scope_table_slot(scope_table *table, char *name) {
+    int i = interned_hash(name) & (table->size - 1);
+    while(table->entries[i] != NULL && table->entries[i]->name != name) {
+        i = (i + 1) & (table->size - 1);
+    }
+    return &table->entries[i];
 }
 
-opstack *create_opstack() {
-    opstack *stack = malloc(sizeof(opstack));
-    stack->start = NULL;
-    stack->end = NULL;
-    return stack;
+void scope_table_grow(scope_table *table) {
+    scope_entry **old = table->entries;
+    int old_size = table->size;
+    int i;
+    table->size <<= 1;
+    table->entries = calloc(table->size, sizeof(scope_entry *));
+    for(i = 0; i < old_size; i++) {
+        if(old[i] != NULL) {
+            *scope_table_slot(table, old[i]->name) = old[i];
+        }
+    }
+    free(old);
+}
+
+void scope_table_add(scope_table *table, variable *var) {
+    scope_entry **slot = scope_table_slot(table, var->name);
+    scope_entry *entry = *slot;
+    if(entry == NULL) {
+        // entries are never removed, so they stay where the log points
+        entry = malloc(sizeof(scope_entry));
+        entry->name = var->name;
+        entry->var = NULL;
+        *slot = entry;
+        table->used++;
+        if(table->used * 2 > table->size) {
+            scope_table_grow(table);
+        }
+    }
+    if(table->log_length == table->log_capacity) {
+        table->log_capacity = table->log_capacity == 0 ? 64 : table->log_capacity * 2;
+        table->log = realloc(table->log, table->log_capacity * sizeof(scope_change));
+    }
+    scope_change *change = &table->log[table->log_length++];
+    change->entry = entry;
+    change->var = var;
+    change->hidden = entry->var;
+    entry->var = var;
 }
 
-void delete_opstack(opstack *stack) {
-    opstack_link *link = stack->start;
-    while(link != NULL) {
-        opstack_link *next = link->next;
-        free(link);
-        link = next;
-    }
-    free(stack);
+variable *scope_table_get(scope_table *table, char *name) {
+    scope_entry *entry = *scope_table_slot(table, name);
+    return entry == NULL ? NULL : entry->var;
 }
 
-void opstack_push(opstack *stack, void *value, int prefix_postfix) {
-    opstack_link *link = create_opstack_link(value, prefix_postfix);
-    if(stack->start == NULL) {
-        stack->start = link;
-        stack->end = link;
-    } else {
-        stack->end->next = link;
-        link->last = stack->end;
-        stack->end = link;
+void scope_table_push(scope_table *table) {
+    if(table->depth == table->scopes_capacity) {
+        table->scopes_capacity = table->scopes_capacity == 0 ? 16 : table->scopes_capacity * 2;
+        table->scopes = realloc(table->scopes, table->scopes_capacity * sizeof(int));
     }
+    table->scopes[table->depth++] = table->log_length;
 }
 
-opstack_link opstack_peek(opstack *stack) {
-    if(stack->end != NULL) {
-        return *(stack->end);
+// undoes the scope's declarations, newest first
+void scope_table_pop(scope_table *table) {
+    int start = table->scopes[--table->depth];
+    while(table->log_length > start) {
+        scope_change *change = &table->log[--table->log_length];
+        change->entry->var = change->hidden;
     }
-    printf("Error: cannot peek stack.\n");
-    exit(1);
-}
-
-opstack_link opstack_pop(opstack *stack) {
-    opstack_link out;
-    if(stack->start == NULL) {
-        printf("Error: cannot pop from stack.\n");
-        exit(1);
-    } else if(stack->start == stack->end) {
-        out = *(stack->start);
-        free(stack->start);
-        stack->end = NULL;
-        stack->start = NULL;
-    } else {
-        out = *(stack->end);
-        stack->end = stack->end->last;
-        free(stack->end->next);
-        stack->end->next = NULL;
-    }
-    return out;
 }
 
-opstack_link opstack_peek_fifo(opstack *stack) {
-    if(stack->start != NULL) {
-        return *(stack->start);
+// moves what's in sight from how it was when the log was from long to how
+// it was when it was to long. The log itself is kept, so it can be seeked
+// forward again later
+void scope_table_seek(scope_table *table, int from, int to) {
+    while(from > to) {
+        scope_change *change = &table->log[--from];
+        change->entry->var = change->hidden;
     }
-    printf("Error: cannot peek stack.\n");
-    exit(1);
-}
-
-opstack_link opstack_pop_fifo(opstack *stack) {
-    opstack_link out;
-    if(stack->start == NULL) {
-        printf("Error: cannot pop from stack.\n");
-        exit(1);
-    } else if(stack->start == stack->end) {
-        out = *(stack->start);
-        free(stack->start);
-        stack->end = NULL;
-        stack->start = NULL;
-    } else {
-        out = *(stack->start);
-        stack->start = stack->start->next;
-        free(stack->start->last);
-        stack->start->last = NULL;
+    while(from < to) {
+        scope_change *change = &table->log[from++];
+        change->entry->var = change->var;
     }
-    return out;
 }
 
-int opstack_empty(opstack *stack) {
-    return stack->start == NULL;
-}
+DEFINE_VECTOR(toklist, token *)
 
-void print_opstack_tokens(opstack *stack) {
-    opstack_link *item = stack->start;
-    int i = 0;
-    printf("[");
-    while(item != NULL) {
-        if(i == 0) {
-            printf("%s", token_to_string(item->value));
-        } else {
-            printf(", %s", token_to_string(item->value));
-        }
-        item = item->next;
-        i++;
-    }
-    printf("]\n");
+token *toklist_get(toklist *list, int id) {
+    return list->items[id];
 }
 
 void global_list_init(global_list *list) {
     list->start = NULL;
     list->end = NULL;
+    region_init(&list->strings);
 }
 
 void global_list_end(global_list *list) {
-    global_link *link = list->start;
-    while(link) {
-        free(link->name);
-        if(link->type == GLOBAL_TYPE_STRING) {
-            free(link->value.string_value);
-        }
-        free(link);
-        link = link->next;
-    }
+    region_end(&list->strings);
     list->start = NULL;
     list->end = NULL;
 }
 
 void global_list_add_string(global_list *list, char *name, char *string) {
-    global_link *link = malloc(sizeof(global_link));
-    link->name = strdup(name);
-    link->value.string_value = strdup(string);
+    global_link *link = region_alloc(&list->strings, sizeof(global_link));
+    link->name = region_strdup(&list->strings, name);
+    link->value.string_value = region_strdup(&list->strings, string);
     link->type = GLOBAL_TYPE_STRING;
     link->next = NULL;
     if(list->start == NULL) {
@@ -1,29 +1,151 @@
 #ifndef DATASTRUCTS_H
 #define DATASTRUCTS_H
 
-#define STRING_BUILDER_GROW_EXPONENTIAL 0
 #define STRING_BUILDER_DEALLOC_ON_CLEAR 0
 
-#define VARLIST_GROW_EXPONENTIAL 0
+// how many items vectors hold before they go to the heap
+#define STRING_BUILDER_INLINE_SIZE 128
+#define VARLIST_INLINE_SIZE 4
+#define TOKLIST_INLINE_SIZE 32
+
+#define INTERN_TABLE_START_SIZE 1024
+
+#define SCOPE_TABLE_START_SIZE 1024
+
+#define REGION_BLOCK_SIZE 65536
 
 typedef struct token token;
 
-typedef struct varlist varlist;
+typedef struct variable variable;
+
+// bump allocation for things that all go at once when a phase of the
+// compile ends. Clearing a region keeps its blocks to be reused, so a
+// region that's cleared over and over stops calling malloc
+typedef struct region_block region_block;
+
+struct region_block {
+    region_block *next;
+    int size;
+    int used;
+};
 
-typedef struct string_builder {
-    int length;
-    int buffer_length;
-    char *buffer;
-} string_builder;
+typedef struct region {
+    region_block *first;
+    region_block *current;
+} region;
 
-void string_builder_init(string_builder *builder);
-void string_builder_end(string_builder *builder);
+void region_init(region *r);
+void region_end(region *r);
+void region_clear(region *r);
 
-void string_builder_add(string_builder *builder, char c);
-char *string_builder_get();
+void *region_alloc(region *r, int size);
+char *region_strdup(region *r, char *string);
+
+// DECLARE_VECTOR(name, type, inline_size) declares a growable array of type
+// and its functions, DEFINE_VECTOR(name, type) defines them. The first
+// inline_size items are kept in the vector itself, so it can't be copied
+// or moved once it's in use. It doubles when it's full, on the heap, or
+// in the region it's given where its old arrays stay until it's cleared.
+#define DECLARE_VECTOR(name, type, inline_size) \
+    typedef struct name name; \
+    struct name { \
+        int length; \
+        int capacity; \
+        type *items; \
+        region *region; \
+        type small[inline_size]; \
+    }; \
+    void name##_init(name *v, region *r); \
+    void name##_end(name *v); \
+    void name##_reserve(name *v, int capacity); \
+    void name##_shrink(name *v); \
+    void name##_add(name *v, type item); \
+    type *name##_detach(name *v);
+
+#define DEFINE_VECTOR(name, type) \
+    void name##_init(name *v, region *r) { \
+        v->length = 0; \
+        v->capacity = sizeof(v->small) / sizeof(type); \
+        v->items = v->small; \
+        v->region = r; \
+    } \
+    \
+    void name##_end(name *v) { \
+        if(v->items != v->small && v->region == NULL) { \
+            free(v->items); \
+        } \
+    } \
+    \
+    void name##_reserve(name *v, int capacity) { \
+        if(capacity <= v->capacity) { \
+            return; \
+        } \
+        type *items; \
+        if(v->region != NULL) { \
+            items = region_alloc(v->region, capacity * sizeof(type)); \
+            memcpy(items, v->items, v->length * sizeof(type)); \
+        } else if(v->items == v->small) { \
+            items = malloc(capacity * sizeof(type)); \
+            memcpy(items, v->items, v->length * sizeof(type)); \
+        } else { \
+            items = realloc(v->items, capacity * sizeof(type)); \
+        } \
+        v->items = items; \
+        v->capacity = capacity; \
+    } \
+    \
+    /* back into the inline items if they'll fit, down to the length if not */ \
+    void name##_shrink(name *v) { \
+        int inline_size = sizeof(v->small) / sizeof(type); \
+        if(v->items == v->small) { \
+            return; \
+        } \
+        if(v->length <= inline_size) { \
+            memcpy(v->small, v->items, v->length * sizeof(type)); \
+            name##_end(v); \
+            v->items = v->small; \
+            v->capacity = inline_size; \
+        } else if(v->region == NULL) { \
+            v->items = realloc(v->items, v->length * sizeof(type)); \
+            v->capacity = v->length; \
+        } \
+    } \
+    \
+    void name##_add(name *v, type item) { \
+        if(v->length == v->capacity) { \
+            name##_reserve(v, v->capacity * 2); \
+        } \
+        v->items[v->length++] = item; \
+    } \
+    \
+    /* the items in an array of their own for the caller to free, leaving */ \
+    /* the vector empty */ \
+    type *name##_detach(name *v) { \
+        type *items = v->items; \
+        if(v->items == v->small || v->region != NULL) { \
+            items = malloc((v->length == 0 ? 1 : v->length) * sizeof(type)); \
+            memcpy(items, v->items, v->length * sizeof(type)); \
+        } \
+        name##_init(v, v->region); \
+        return items; \
+    }
+
+DECLARE_VECTOR(string_builder, char, STRING_BUILDER_INLINE_SIZE)
+
+char *string_builder_get(string_builder *builder);
 char string_builder_get_char(string_builder *builder, int offset);
 void string_builder_clear(string_builder *builder);
 
+// every distinct identifier is stored once, so names can be compared by
+// pointer and their hash is always at hand
+void intern_init();
+void intern_end();
+
+char *intern_string(char *string, int length);
+char *intern_string_hashed(char *string, int length, unsigned int hash);
+unsigned int intern_hash(char *string, int length);
+unsigned int interned_hash(char *interned);
+
 enum {
     VARTYPE_VOID,
     VARTYPE_CHAR,
@@ -35,7 +157,10 @@ enum {
     VARTYPE_UNION
 };
 
-typedef struct variable {
+// the list grows within the region it was made in, if any
+DECLARE_VECTOR(varlist, variable *, VARLIST_INLINE_SIZE)
+
+struct variable {
     //int global_id;
     
     char *name;
@@ -51,65 +176,60 @@ typedef struct variable {
     int scope_level;
     
     varlist *arguments;
-} variable;
+    // a function's body skipped by lazy parsing, an index into the
+    // parser's lazy bodies, -1 if it's parsed where it's defined
+    int lazy_body;
+};
 
-variable *create_variable();
-void delete_variable();
+variable *create_variable(region *r);
 int get_variable_size(variable *in);
 int get_variable_size_nopointer(variable *in);
 
-struct varlist {
-    int bytes_size;
-    int length;
-    int buffer_length;
-    variable **list;
-};
-
-varlist *create_varlist();
-void delete_varlist(varlist *list);
+varlist *create_varlist(region *r);
 
-void varlist_add(varlist *list, variable *var);
 variable *varlist_get(varlist *list, int id);
 void print_varlist(varlist *list);
 
-typedef struct toklist {
-    int length;
-    int buffer_length;
-    token **list;
-} toklist;
-
-toklist *create_toklist();
-void delete_toklist(toklist *list);
+// the variables visible by name, open addressing on the interned name.
+// Every declaration is logged with the variable it hides, so leaving a
+// scope puts back just what the scope changed.
+typedef struct scope_entry {
+    char *name;
+    // NULL once it's gone out of scope
+    variable *var;
+} scope_entry;
 
-void toklist_add(toklist *list, token *var);
-token *toklist_get(toklist *list, int id);
+typedef struct scope_change {
+    scope_entry *entry;
+    variable *var;
+    variable *hidden;
+} scope_change;
 
-typedef struct opstack_link opstack_link;
+typedef struct scope_table {
+    scope_entry **entries;
+    int size;
+    int used;
+    scope_change *log;
+    int log_length;
+    int log_capacity;
+    // where each open scope starts in the log
+    int *scopes;
+    int depth;
+    int scopes_capacity;
+} scope_table;
 
-struct opstack_link {
-    void *value;
-    int prefix_postfix;
-    opstack_link *last;
-    opstack_link *next;
-};
+scope_table *create_scope_table();
+void delete_scope_table(scope_table *table);
 
-typedef struct opstack {
-    opstack_link *start;
-    opstack_link *end;
-} opstack;
+void scope_table_add(scope_table *table, variable *var);
+variable *scope_table_get(scope_table *table, char *name);
+void scope_table_push(scope_table *table);
+void scope_table_pop(scope_table *table);
+void scope_table_seek(scope_table *table, int from, int to);
 
-opstack *create_opstack();
-void delete_opstack(opstack *stack);
+DECLARE_VECTOR(toklist, token *, TOKLIST_INLINE_SIZE)
 
-void opstack_push(opstack *stack, void *value, int prefix_postfix);
-opstack_link opstack_peek(opstack *stack);
-opstack_link opstack_pop(opstack *stack);
-opstack_link opstack_peek_fifo(opstack *stack);
-opstack_link opstack_pop_fifo(opstack *stack);
-int opstack_empty(opstack *stack);
-
-// only use this if the opstack contains tokens
-void print_opstack_tokens(opstack *stack);
+token *toklist_get(toklist *list, int id);
 
 enum {
     GLOBAL_TYPE_STRING
@@ -129,6 +249,8 @@ struct global_link {
 typedef struct global_list {
     global_link *start;
     global_link *end;
+    // the links and their strings, gone with global_list_end()
+    region strings;
 } global_list;
 
 void global_list_init(global_list *list);
@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "include.h"
+#include "datastructs.h"
+
+#if INCLUDE_USE_DIRECTORY_CACHE
+    #include <dirent.h>
+#endif
+#if INCLUDE_USE_PREFETCH
+    #include <pthread.h>
+#endif
+
+typedef struct include_path {
+    char *directory;
+    int system;
+} include_path;
+
+// given on the command line, so they're kept for the whole run rather
+// than going with end_include() like the cache
+include_path *include_paths;
+int include_path_count;
+
+enum {
+    PREFETCH_NONE,
+    PREFETCH_QUEUED,
+    PREFETCH_READING,
+    PREFETCH_DONE,
+    // handed over to the tokenizer, or it read the file itself
+    PREFETCH_TAKEN
+};
+
+enum {
+    LIST_NONE,
+    LIST_DONE,
+    // it can't be read, so names in it are looked up with stat()
+    LIST_FAILED
+};
+
+// what's known about a path, kept by its interned name
+typedef struct fs_entry {
+    char *path;
+    // stat() has been called, or the directory listing showed there's
+    // nothing there
+    int stat_done;
+    int exists;
+    int is_directory;
+    unsigned long long device;
+    unsigned long long inode;
+    // for a directory, the interned names in it, open addressing
+    int list_state;
+    char **names;
+    int names_size;
+    // the file's contents once a prefetch thread has read them, only
+    // touched with prefetch_lock held
+    int prefetch_state;
+    char *buffer;
+    int length;
+} fs_entry;
+
+fs_entry **fs_table;
+int fs_table_size;
+int fs_table_used;
+
+int include_prefetching;
+
+#if INCLUDE_USE_PREFETCH
+    // entries waiting for a thread, first in first out
+    fs_entry **prefetch_queue;
+    int prefetch_queue_start;
+    int prefetch_queue_count;
+    int prefetch_queue_size;
+    int prefetch_stopping;
+    int prefetch_started;
+    pthread_t prefetch_threads[INCLUDE_PREFETCH_THREADS];
+    pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+    // signalled when there's more in the queue, and when a read finishes
+    pthread_cond_t prefetch_work = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;
+#endif
+
+void include_add_path(char *directory, int system) {
+    int i;
+    if((include_path_count & (include_path_count - 1)) == 0) {
+        include_paths = realloc(include_paths, (include_path_count == 0 ? 1 : include_path_count * 2) * sizeof(include_path));
+    }
+    // -I ones go before the first -isystem one
+    for(i = include_path_count; i > 0 && !system && include_paths[i - 1].system; i--) {
+        include_paths[i] = include_paths[i - 1];
+    }
+    include_paths[i].directory = directory;
+    include_paths[i].system = system;
+    include_path_count++;
+}
+
+void fs_table_grow() {
+    fs_entry **old = fs_table;
+    int old_size = fs_table_size;
+    int i;
+    fs_table_size <<= 1;
+    fs_table = calloc(fs_table_size, sizeof(fs_entry *));
+    for(i = 0; i < old_size; i++) {
+        if(old[i] != NULL) {
+            int j = interned_hash(old[i]->path) & (fs_table_size - 1);
+            while(fs_table[j] != NULL) {
+                j = (j + 1) & (fs_table_size - 1);
+            }
+            fs_table[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+// the entry for an interned path, made the first time it's asked for
+fs_entry *fs_lookup(char *path) {
+    int i = interned_hash(path) & (fs_table_size - 1);
+    while(fs_table[i] != NULL) {
+        if(fs_table[i]->path == path) {
+            return fs_table[i];
+        }
+        i = (i + 1) & (fs_table_size - 1);
+    }
+    fs_entry *entry = calloc(1, sizeof(fs_entry));
+    entry->path = path;
+    fs_table[i] = entry;
+    fs_table_used++;
+    if(fs_table_used * 2 > fs_table_size) {
+        fs_table_grow();
+    }
+    return entry;
+}
+
+void fs_stat(fs_entry *entry) {
+    struct stat st;
+    entry->stat_done = 1;
+    entry->exists = stat(entry->path, &st) == 0;
+    if(entry->exists) {
+        entry->is_directory = S_ISDIR(st.st_mode);
+        entry->device = st.st_dev;
+        entry->inode = st.st_ino;
+    }
+}
+
+#if INCLUDE_USE_DIRECTORY_CACHE
+    void fs_add_name(fs_entry *directory, char *name) {
+        int i = interned_hash(name) & (directory->names_size - 1);
+        while(directory->names[i] != NULL) {
+            i = (i + 1) & (directory->names_size - 1);
+        }
+        directory->names[i] = name;
+    }
+
+    int fs_has_name(fs_entry *directory, char *name) {
+        int i;
+        if(directory->names == NULL) {
+            return 0;
+        }
+        i = interned_hash(name) & (directory->names_size - 1);
+        while(directory->names[i] != NULL) {
+            if(directory->names[i] == name) {
+                return 1;
+            }
+            i = (i + 1) & (directory->names_size - 1);
+        }
+        return 0;
+    }
+
+    void fs_list(fs_entry *directory) {
+        DIR *dir = opendir(directory->path);
+        struct dirent *file;
+        int count = 0;
+        if(dir == NULL) {
+            // a directory that isn't there has nothing in it
+            directory->list_state = errno == ENOENT || errno == ENOTDIR ? LIST_DONE : LIST_FAILED;
+            return;
+        }
+        while((file = readdir(dir)) != NULL) {
+            char *name = intern_string(file->d_name, strlen(file->d_name));
+            // kept at most half full
+            if(count * 2 >= directory->names_size) {
+                char **old = directory->names;
+                int old_size = directory->names_size;
+                int i;
+                directory->names_size = old_size == 0 ? 16 : old_size * 2;
+                directory->names = calloc(directory->names_size, sizeof(char *));
+                for(i = 0; i < old_size; i++) {
+                    if(old[i] != NULL) {
+                        fs_add_name(directory, old[i]);
+                    }
+                }
+                free(old);
+            }
+            fs_add_name(directory, name);
+            count++;
+        }
+        closedir(dir);
+        directory->list_state = LIST_DONE;
+    }
+#endif
+
+// whether path is a file that can be included
+int fs_is_file(char *path, int length) {
+    fs_entry *entry = fs_lookup(intern_string(path, length));
+    #if INCLUDE_USE_DIRECTORY_CACHE
+        if(!entry->stat_done) {
+            char *slash = NULL;
+            char *name;
+            fs_entry *directory;
+            int i;
+            for(i = length - 1; i >= 0 && slash == NULL; i--) {
+                if(path[i] == '/') {
+                    slash = path + i;
+                }
+            }
+            name = slash == NULL ? path : slash + 1;
+            if(slash == NULL) {
+                directory = fs_lookup(intern_string(".", 1));
+            } else {
+                directory = fs_lookup(intern_string(path, slash == path ? 1 : slash - path));
+            }
+            if(directory->list_state == LIST_NONE) {
+                fs_list(directory);
+            }
+            if(directory->list_state == LIST_DONE && !fs_has_name(directory, intern_string(name, length - (name - path)))) {
+                entry->stat_done = 1;
+                entry->exists = 0;
+            }
+        }
+    #endif
+    if(!entry->stat_done) {
+        fs_stat(entry);
+    }
+    return entry->exists && !entry->is_directory;
+}
+
+// directory and name joined with a /, NULL if that isn't a file
+char *include_try(string_builder *path, char *directory, int directory_length, char *name) {
+    int i;
+    string_builder_clear(path);
+    for(i = 0; i < directory_length; i++) {
+        string_builder_add(path, directory[i]);
+    }
+    if(directory_length > 0 && directory[directory_length - 1] != '/') {
+        string_builder_add(path, '/');
+    }
+    for(i = 0; name[i] != '\0'; i++) {
+        string_builder_add(path, name[i]);
+    }
+    char *full = string_builder_get(path);
+    if(fs_is_file(full, path->length)) {
+        return intern_string(full, path->length);
+    }
+    return NULL;
+}
+
+char *include_resolve(char *name, char *including_file, int quoted) {
+    string_builder path;
+    char *found = NULL;
+    int i;
+    string_builder_init(&path, NULL);
+    if(name[0] == '/') {
+        found = include_try(&path, "", 0, name);
+    } else {
+        if(quoted) {
+            // TODO: make this cross-platform
+            char *slash = strrchr(including_file, '/');
+            found = include_try(&path, including_file, slash == NULL ? 0 : slash - including_file + 1, name);
+        }
+        for(i = 0; i < include_path_count && found == NULL; i++) {
+            found = include_try(&path, include_paths[i].directory, strlen(include_paths[i].directory), name);
+        }
+    }
+    string_builder_end(&path);
+    return found;
+}
+
+int include_file_id(char *path, unsigned long long *device, unsigned long long *inode) {
+    fs_entry *entry = fs_lookup(intern_string(path, strlen(path)));
+    if(!entry->stat_done) {
+        fs_stat(entry);
+    }
+    *device = entry->device;
+    *inode = entry->inode;
+    return entry->exists;
+}
+
+#if INCLUDE_USE_PREFETCH
+    // reads the whole file, the entry's path is never changed so it can be
+    // used without the lock
+    void prefetch_read(fs_entry *entry) {
+        FILE *file = fopen(entry->path, "rb");
+        struct stat st;
+        char *buffer = NULL;
+        int length = 0;
+        if(file != NULL && fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)) {
+            buffer = malloc(st.st_size + 1);
+            length = fread(buffer, 1, st.st_size, file);
+            if(ferror(file)) {
+                free(buffer);
+                buffer = NULL;
+            }
+        }
+        if(file != NULL) {
+            fclose(file);
+        }
+        pthread_mutex_lock(&prefetch_lock);
+        entry->buffer = buffer;
+        entry->length = length;
+        entry->prefetch_state = PREFETCH_DONE;
+        pthread_cond_broadcast(&prefetch_done);
+        pthread_mutex_unlock(&prefetch_lock);
+    }
+    
+    void *prefetch_run(void *data) {
+        (void)data;
+        pthread_mutex_lock(&prefetch_lock);
+        while(1) {
+            while(prefetch_queue_count == 0 && !prefetch_stopping) {
+                pthread_cond_wait(&prefetch_work, &prefetch_lock);
+            }
+            if(prefetch_stopping) {
+                break;
+            }
+            fs_entry *entry = prefetch_queue[prefetch_queue_start];
+            prefetch_queue_start = (prefetch_queue_start + 1) & (prefetch_queue_size - 1);
+            prefetch_queue_count--;
+            // the tokenizer may have got to it first
+            if(entry->prefetch_state != PREFETCH_QUEUED) {
+                continue;
+            }
+            entry->prefetch_state = PREFETCH_READING;
+            pthread_mutex_unlock(&prefetch_lock);
+            prefetch_read(entry);
+            pthread_mutex_lock(&prefetch_lock);
+        }
+        pthread_mutex_unlock(&prefetch_lock);
+        return NULL;
+    }
+#endif
+
+void include_prefetch(char *path) {
+    #if INCLUDE_USE_PREFETCH
+        fs_entry *entry = fs_lookup(intern_string(path, strlen(path)));
+        int i;
+        pthread_mutex_lock(&prefetch_lock);
+        if(entry->prefetch_state != PREFETCH_NONE) {
+            pthread_mutex_unlock(&prefetch_lock);
+            return;
+        }
+        if(!prefetch_started) {
+            prefetch_started = 1;
+            for(i = 0; i < INCLUDE_PREFETCH_THREADS; i++) {
+                pthread_create(&prefetch_threads[i], NULL, prefetch_run, NULL);
+            }
+        }
+        // a ring that doubles when full, a power of 2
+        if(prefetch_queue_count == prefetch_queue_size) {
+            fs_entry **queue = malloc((prefetch_queue_size == 0 ? 16 : prefetch_queue_size * 2) * sizeof(fs_entry *));
+            for(i = 0; i < prefetch_queue_count; i++) {
+                queue[i] = prefetch_queue[(prefetch_queue_start + i) & (prefetch_queue_size - 1)];
+            }
+            free(prefetch_queue);
+            prefetch_queue = queue;
+            prefetch_queue_start = 0;
+            prefetch_queue_size = prefetch_queue_size == 0 ? 16 : prefetch_queue_size * 2;
+        }
+        prefetch_queue[(prefetch_queue_start + prefetch_queue_count) & (prefetch_queue_size - 1)] = entry;
+        prefetch_queue_count++;
+        entry->prefetch_state = PREFETCH_QUEUED;
+        pthread_cond_signal(&prefetch_work);
+        pthread_mutex_unlock(&prefetch_lock);
+    #endif
+}
+
+char *include_prefetched(char *path, int *length) {
+    #if INCLUDE_USE_PREFETCH
+        fs_entry *entry = fs_lookup(intern_string(path, strlen(path)));
+        char *buffer = NULL;
+        pthread_mutex_lock(&prefetch_lock);
+        while(entry->prefetch_state == PREFETCH_READING) {
+            pthread_cond_wait(&prefetch_done, &prefetch_lock);
+        }
+        if(entry->prefetch_state == PREFETCH_DONE) {
+            buffer = entry->buffer;
+            *length = entry->length;
+            entry->buffer = NULL;
+        }
+        // still queued, it's quicker to read it now than wait
+        if(entry->prefetch_state != PREFETCH_NONE) {
+            entry->prefetch_state = PREFETCH_TAKEN;
+        }
+        pthread_mutex_unlock(&prefetch_lock);
+        return buffer;
+    #else
+        return NULL;
+    #endif
+}
+
+void init_include() {
+    fs_table_size = INCLUDE_TABLE_START_SIZE;
+    fs_table_used = 0;
+    fs_table = calloc(fs_table_size, sizeof(fs_entry *));
+}
+
+void end_include() {
+    int i;
+    #if INCLUDE_USE_PREFETCH
+        if(prefetch_started) {
+            pthread_mutex_lock(&prefetch_lock);
+            prefetch_stopping = 1;
+            pthread_cond_broadcast(&prefetch_work);
+            pthread_mutex_unlock(&prefetch_lock);
+            for(i = 0; i < INCLUDE_PREFETCH_THREADS; i++) {
+                pthread_join(prefetch_threads[i], NULL);
+            }
+            prefetch_started = 0;
+            prefetch_stopping = 0;
+        }
+        free(prefetch_queue);
+        prefetch_queue = NULL;
+        prefetch_queue_start = 0;
+        prefetch_queue_count = 0;
+        prefetch_queue_size = 0;
+    #endif
+    for(i = 0; i < fs_table_size; i++) {
+        if(fs_table[i] != NULL) {
+            // read but never included
+            free(fs_table[i]->buffer);
+            free(fs_table[i]->names);
+            free(fs_table[i]);
+        }
+    }
+    free(fs_table);
+    fs_table = NULL;
+}
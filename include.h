@@ -0,0 +1,48 @@
+#ifndef INCLUDE_H
+#define INCLUDE_H
+
+// where #include finds files. Every path probed is remembered, whether it
+// exists or not, and each directory is listed once, so a name that isn't
+// in a directory is ruled out without a stat() of its own
+#if defined(__unix__) || defined(__APPLE__)
+    #define INCLUDE_USE_DIRECTORY_CACHE 1
+#else
+    #define INCLUDE_USE_DIRECTORY_CACHE 0
+#endif
+
+#define INCLUDE_TABLE_START_SIZE 256
+
+// with include_prefetching set, the files a file includes are read into
+// memory on this many threads while it's being lexed, so they're ready by
+// the time the tokenizer gets to them
+#if defined(__unix__) || defined(__APPLE__)
+    #define INCLUDE_USE_PREFETCH 1
+#else
+    #define INCLUDE_USE_PREFETCH 0
+#endif
+#define INCLUDE_PREFETCH_THREADS 2
+
+extern int include_prefetching;
+
+// -I and -isystem directories, searched in the order they're given with
+// every -I one before any -isystem one. They stay through every
+// init_include() and end_include().
+void include_add_path(char *directory, int system);
+
+// the path of the file an #include names, interned, or NULL if there's no
+// such file. Quoted names are looked for next to the including file first.
+char *include_resolve(char *name, char *including_file, int quoted);
+
+// stat() through the cache, returns 0 if there's no such file
+int include_file_id(char *path, unsigned long long *device, unsigned long long *inode);
+
+// starts reading path on a prefetch thread, if it hasn't been already
+void include_prefetch(char *path);
+// the contents of path if a prefetch thread read it, waiting for it if
+// it's still being read, or NULL if it wasn't prefetched
+char *include_prefetched(char *path, int *length);
+
+void init_include();
+void end_include();
+
+#endif
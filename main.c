@@ -6,6 +6,8 @@
 #include "tokenizer.h"
 #include "parser.h"
 #include "codegen.h"
+#include "pch.h"
+#include "include.h"
 
 extern tokenizer *current_tokenizer;
 
@@ -29,36 +31,134 @@ int main(int argc, char *argv[]) {
     char *output_filename = "stdout";
     FILE *input = stdin;
     FILE *output = stdout;
-    if(argc == 2) {
-        input_filename = argv[1];
+    char *files[2];
+    int file_count = 0;
+    char *emit_pch = NULL;
+    char *include_pch = NULL;
+    // -MD, -MF and -MP
+    int dependencies = 0;
+    char *dependency_file = NULL;
+    int phony_dependencies = 0;
+    int i;
+    for(i = 1; i < argc; i++) {
+        if(strncmp(argv[i], "--lex-threads=", 14) == 0) {
+            tokenizer_threads = atoi(argv[i] + 14);
+        } else if(strcmp(argv[i], "--pipeline") == 0) {
+            tokenizer_pipeline = 1;
+        } else if(strncmp(argv[i], "--emit-pch=", 11) == 0) {
+            emit_pch = argv[i] + 11;
+        } else if(strncmp(argv[i], "--include-pch=", 14) == 0) {
+            include_pch = argv[i] + 14;
+        } else if(strcmp(argv[i], "--lazy-bodies") == 0) {
+            parser_lazy_bodies = 1;
+        } else if(strcmp(argv[i], "--prefetch-includes") == 0) {
+            include_prefetching = 1;
+        } else if(strcmp(argv[i], "-MD") == 0) {
+            dependencies = 1;
+        } else if(strncmp(argv[i], "-MF", 3) == 0) {
+            // only used with -MD, as with gcc
+            dependency_file = argv[i] + 3;
+            if(*dependency_file == '\0') {
+                if(i + 1 == argc) {
+                    fprintf(stderr, "-MF needs a file name\n");
+                    return 1;
+                }
+                dependency_file = argv[++i];
+            }
+        } else if(strcmp(argv[i], "-MP") == 0) {
+            phony_dependencies = 1;
+        } else if(strncmp(argv[i], "-isystem", 8) == 0 || strncmp(argv[i], "-I", 2) == 0) {
+            // the directory can be joined on or the next argument
+            int system = argv[i][1] == 'i';
+            char *directory = argv[i] + (system ? 8 : 2);
+            if(*directory == '\0') {
+                if(i + 1 == argc) {
+                    fprintf(stderr, "%s needs a directory\n", argv[i]);
+                    return 1;
+                }
+                directory = argv[++i];
+            }
+            include_add_path(directory, system);
+        } else if(file_count < 2) {
+            files[file_count++] = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--lex-threads=n] [--pipeline] [--emit-pch=file] [--include-pch=file] [--lazy-bodies] [--prefetch-includes] [-I dir] [-isystem dir] [-MD] [-MF file] [-MP] [input] [output]\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    if(file_count == 1) {
+        input_filename = files[0];
         input = fopen(input_filename, "r");
         if(input == NULL) {
             fprintf(stderr, "%s\n", strerror(errno));
             return 1;
         }
-    } else if(argc == 3) {
-        input_filename = argv[1];
-        output_filename = argv[2];
+    } else if(file_count == 2) {
+        input_filename = files[0];
+        output_filename = files[1];
         input = fopen(input_filename, "r");
         output = fopen(output_filename, "w");
         if(input == NULL || output == NULL) {
             fprintf(stderr, "%s\n", strerror(errno));
             return 1;
         }
-    } else if(argc > 3) {
-        fprintf(stderr, "Usage: %s [input] [output]\n", argv[0]);
-        return 1;
+    }
+    
+    // a header is precompiled whole, whatever ends up using it
+    if(emit_pch != NULL) {
+        parser_lazy_bodies = 0;
     }
     
     init_tokenizer();
+    init_parser();
+    
+    // declared before anything in the input
+    tree header = 0;
+    if(include_pch != NULL) {
+        header = pch_load(include_pch);
+    }
     
     current_tokenizer = tokenizer_create(NULL, input, input_filename);
+    source_file *input_source = current_tokenizer->source;
     
     //debug_tokens();
     
-    tree *AST = parse();
+    tree AST = parse();
     
-    FILE *outputf = fopen("output.sall", "w");
+    // what make is told is built from the files that were read
+    char *target = emit_pch != NULL ? emit_pch : file_count == 2 ? output_filename : "output.sall";
+    if(dependencies) {
+        if(dependency_file == NULL) {
+            // the target with its extension swapped for .d
+            char *dot = strrchr(target, '.');
+            char *slash = strrchr(target, '/');
+            int length = dot != NULL && (slash == NULL || dot > slash) ? (int)(dot - target) : (int)strlen(target);
+            dependency_file = malloc(length + 3);
+            memcpy(dependency_file, target, length);
+            strcpy(dependency_file + length, ".d");
+        }
+        write_dependencies(dependency_file, target, input_source, phony_dependencies);
+    }
+    
+    if(emit_pch != NULL) {
+        pch_emit(emit_pch, AST);
+        end_parser();
+        end_tokenizer();
+        return 0;
+    }
+    
+    if(header != 0) {
+        tree last = header;
+        while(tree_right(last) != 0) {
+            last = tree_right(last);
+        }
+        tree_right(last) = AST;
+        AST = header;
+    }
+    
+    // the output file if one was given, the make rule names this file too
+    FILE *outputf = file_count == 2 ? output : fopen("output.sall", "w");
     
     if(outputf == NULL) {
         printf("Cannot open file for writing.\n");
@@ -66,8 +166,9 @@ int main(int argc, char *argv[]) {
     }
     
     generate(outputf, AST);
-    
-    // TODO: free reader
+    fclose(outputf);
+    end_parser();
+    end_tokenizer();
     
     return 0;
 }
@@ -5,7 +5,7 @@
 #include "optimizer.h"
 #include "tokenizer.h"
 
-tree *compute_16bit(token *operator, uint16_t a, uint16_t b) {
+tree compute_16bit(token *operator, uint16_t a, uint16_t b) {
     uint16_t output;
     switch(operator->type) {
         case TOK_DIVIDE:
@@ -63,12 +63,12 @@ tree *compute_16bit(token *operator, uint16_t a, uint16_t b) {
             output = a & b;
             break;
     }
-    tree *out = create_tree(TREETYPE_INTEGER);
-    out->data.int_value = output;
+    tree out = create_tree(TREETYPE_INTEGER);
+    tree_data(out).int_value = output;
     return out;
 }
 
-tree *compute_8bit(token *operator, uint8_t a, uint8_t b) {
+tree compute_8bit(token *operator, uint8_t a, uint8_t b) {
     uint8_t output;
     switch(operator->type) {
         case TOK_DIVIDE:
@@ -126,45 +126,45 @@ tree *compute_8bit(token *operator, uint8_t a, uint8_t b) {
             output = a & b;
             break;
     }
-    tree *out = create_tree(TREETYPE_CHAR);
-    out->data.int_value = output;
+    tree out = create_tree(TREETYPE_CHAR);
+    tree_data(out).int_value = output;
     return out;
 }
 
-tree *optimize_expression(tree *in) {
-    if(in->type == TREETYPE_OPERATOR) {
-        if(is_single_argument(in->data.tok->type)) {
-            optimize_expression(in->left);
+tree optimize_expression(tree in) {
+    if(tree_type(in) == TREETYPE_OPERATOR) {
+        if(is_single_argument(tree_data(in).tok->type)) {
+            optimize_expression(tree_left(in));
             return in;
         } else {
-            in->left = optimize_expression(in->left);
-            in->right = optimize_expression(in->right);
-            int a = in->left->type;
-            int b = in->right->type;
+            tree_set_left(in, optimize_expression(tree_left(in)));
+            tree_set_right(in, optimize_expression(tree_right(in)));
+            int a = tree_type(tree_left(in));
+            int b = tree_type(tree_right(in));
             if((a == TREETYPE_INTEGER || a == TREETYPE_CHAR) && (b == TREETYPE_INTEGER || b == TREETYPE_CHAR)) {
                 if(a == TREETYPE_INTEGER || b == TREETYPE_INTEGER) {
-                    tree *out = compute_16bit(in->data.tok, in->left->data.int_value, in->right->data.int_value);
-                    if(out == NULL) {
+                    tree out = compute_16bit(tree_data(in).tok, tree_data(tree_left(in)).int_value, tree_data(tree_right(in)).int_value);
+                    if(out == 0) {
                         return in;
                     }
-                    printf("optimizing %d %s %d = %d\n", in->left->data.int_value, get_string_from_toktype(in->data.tok->type), in->right->data.int_value, out->data.int_value);
+                    printf("optimizing %d %s %d = %d\n", tree_data(tree_left(in)).int_value, get_string_from_toktype(tree_data(in).tok->type), tree_data(tree_right(in)).int_value, tree_data(out).int_value);
                     return out;
                 } else {
-                    tree *out = compute_8bit(in->data.tok, in->left->data.int_value, in->right->data.int_value);
-                    if(out == NULL) {
+                    tree out = compute_8bit(tree_data(in).tok, tree_data(tree_left(in)).int_value, tree_data(tree_right(in)).int_value);
+                    if(out == 0) {
                         return in;
                     }
-                    printf("optimizing %d %s %d = %d\n", in->left->data.int_value, get_string_from_toktype(in->data.tok->type), in->right->data.int_value, out->data.int_value);
+                    printf("optimizing %d %s %d = %d\n", tree_data(tree_left(in)).int_value, get_string_from_toktype(tree_data(in).tok->type), tree_data(tree_right(in)).int_value, tree_data(out).int_value);
                     return out;
                 }
             } else {
                 return in;
             }
         }
-    } else if(in->type == TREETYPE_VARIABLE || in->type == TREETYPE_INTEGER || in->type == TREETYPE_STRING || in->type == TREETYPE_CHAR) {
+    } else if(tree_type(in) == TREETYPE_VARIABLE || tree_type(in) == TREETYPE_INTEGER || tree_type(in) == TREETYPE_STRING || tree_type(in) == TREETYPE_CHAR) {
         return in;
     } else {
-        printf("weird tree type: %d\n", in->type);
+        printf("weird tree type: %d\n", tree_type(in));
         exit(1);
     }
 }
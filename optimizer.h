@@ -3,6 +3,6 @@
 
 #include "parser.h"
 
-tree *optimize_expression(tree *in);
+tree optimize_expression(tree in);
 
 #endif
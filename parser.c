@@ -8,7 +8,10 @@
 #include "optimizer.h"
 
 //#define PARSER_DEBUG
-#define PRINT_AST
+// off for the stress tests, whose ASTs are too big to print
+#ifndef NO_PRINT_AST
+    #define PRINT_AST
+#endif
 
 #define expect(...) _expect_1((sizeof((int[]){__VA_ARGS__})/sizeof(int)), __VA_ARGS__)
 #define expect_peek(...) _expect_peek((sizeof((int[]){__VA_ARGS__})/sizeof(int)), __VA_ARGS__)
@@ -23,21 +26,60 @@
     #define error(...) _error(__VA_ARGS__)
 #endif
 
+// every variable ever declared, and the ones in scope by name
 varlist *all_vars;
-varlist *local_vars;
+scope_table *visible_vars;
 int current_scope;
+char *percent_string;
+
+// the AST of the translation unit being parsed
+tree_pool *current_ast;
+// its variables and their argument lists, gone with end_parser()
+region parser_region;
+
+int parser_lazy_bodies;
+char *main_string;
+char *interrupt_string;
+
+// a function body lazy parsing skipped, its tokens from { to } in
+// lazy_tokens and the declaration it becomes once it's parsed
+typedef struct lazy_body {
+    variable *var;
+    tree definition;
+    int start;
+    int length;
+    // how much of the scope log was in sight outside the function where
+    // it was skipped, and the function's scope level, so it's parsed as
+    // if it were still there
+    int visible;
+    int scope_level;
+    // set once something refers to it, with the next body waiting to be
+    // parsed after it
+    int reached;
+    int next;
+} lazy_body;
+
+DECLARE_VECTOR(lazy_body_list, lazy_body, LAZY_BODIES_INLINE_SIZE)
+DEFINE_VECTOR(lazy_body_list, lazy_body)
+
+lazy_body_list lazy_bodies;
+toklist lazy_tokens;
+// the reached bodies that haven't been parsed yet, -1 for none
+int lazy_pending;
 
 variable *parse_type();
 void parse_arg_definition(varlist *arglist);
-tree *parse_expression();
-tree *parse_while();
-tree *parse_if();
-tree *parse_for();
-tree *parse_switch();
-tree *parse_code();
-tree *parse_declaration();
-tree *parse_declaration_list();
-tree *parse();
+tree parse_expression();
+tree parse_while();
+tree parse_if();
+tree parse_for();
+tree parse_switch();
+tree parse_code();
+tree parse_block();
+tree parse_declaration();
+tree parse_declaration_list();
+tree parse();
+void reach_lazy_body(variable *var);
 
 // for stack trace printing in GDB
 void cause_segfault() {
@@ -46,48 +88,36 @@ void cause_segfault() {
 }
 
 extern tokenizer *current_tokenizer;
-extern toklist *tokens_to_free;
 
 void _debug(int i, char *format, ...) {
     token *tok;
     // <hacky>
-    if(i || tokens_to_free->length == 0) {
+    if(i || tokenizer_last() == NULL) {
         tok = tokenizer_peek();
     } else {
-        tok = tokens_to_free->list[tokens_to_free->length - 1];
+        tok = tokenizer_last();
     }
     // </hacky>
-    printf("\x1b[1m%s:%d:12:\x1b[0m ", current_tokenizer->filename, current_tokenizer->line_num, tok->line_offset - 1);
+    int line, column;
+    token_position(tok, &line, &column);
+    printf("\x1b[1m%s:%d:%d:\x1b[0m ", token_filename(tok), line, column + 1);
     va_list ap;
     va_start(ap, format);
     vprintf(format, ap);
     va_end(ap);
-    if(tok->line_offset != -1) {
-        char *line = string_builder_get(&current_tokenizer->current_line);
-        int pos = tok->line_offset - 1;
-        int len = tok->length;
-        printf("%.*s", pos, line);
-        printf("\x1b[92;1m%.*s\x1b[0m", tok->length, line + pos);
-        printf("%.*s\n", current_tokenizer->current_line.length - (pos + len), line + pos + len);
-        printf("\x1b[92;1m%*s^\x1b[0m\n\n", tok->line_offset - 1, "");
-    }
+    print_token_source(tok, "92;1");
+    printf("\n");
 }
 
 void _error(token *tok, char *format, ...) {
-    printf("\x1b[1m%s:%d:12:\x1b[0m \x1b[91;1merror:\x1b[0m ", current_tokenizer->filename, current_tokenizer->line_num, tok->line_offset - 1);
+    int line, column;
+    token_position(tok, &line, &column);
+    printf("\x1b[1m%s:%d:%d:\x1b[0m \x1b[91;1merror:\x1b[0m ", token_filename(tok), line, column + 1);
     va_list ap;
     va_start(ap, format);
     vprintf(format, ap);
     va_end(ap);
-    if(tok->line_offset != -1) {
-        char *line = string_builder_get(&current_tokenizer->current_line);
-        int pos = tok->line_offset - 1;
-        int len = tok->length;
-        printf("%.*s", pos, line);
-        printf("\x1b[91;1m%.*s\x1b[0m", tok->length, line + pos);
-        printf("%.*s\n", current_tokenizer->current_line.length - (pos + len), line + pos + len);
-        printf("\x1b[91;1m%*s^\x1b[0m\n", tok->line_offset - 1, "");
-    }
+    print_token_source(tok, "91;1");
     //cause_segfault();
     exit(1);
 }
@@ -96,29 +126,24 @@ void add_variable(variable *var) {
     //var->global_id = all_vars->length;
     var->scope_level = current_scope;
     varlist_add(all_vars, var);
-    varlist_add(local_vars, var);
+    scope_table_add(visible_vars, var);
 }
 
-void clear_current_scope() {
-    int i;
-    for(i = local_vars->length - 1; i >= 0; i--) {
-        if(local_vars->list[i]->scope_level != current_scope) {
-            return;
-        }
-        local_vars->length = i;
-    }
+void open_scope() {
+    current_scope++;
+    scope_table_push(visible_vars);
+}
+
+// the scope's variables go out of sight and any they hid come back
+void close_scope() {
+    scope_table_pop(visible_vars);
+    current_scope--;
 }
 
-// tok should always be an identifier
+// tok should always be an identifier, names are interned so they're
+// looked up by pointer
 variable *get_variable_noerror(token *tok) {
-    char *s = tok->string;
-    int i;
-    for(i = local_vars->length - 1; i >= 0; i--) {
-        if(strcmp(s, local_vars->list[i]->name) == 0) {
-            return local_vars->list[i];
-        }
-    }
-    return NULL;
+    return scope_table_get(visible_vars, tok->string);
 }
 
 variable *get_variable(token *tok) {
@@ -126,6 +151,9 @@ variable *get_variable(token *tok) {
     if(out == NULL) {
         error(tok, "Unknown identifier\n");
     }
+    if(out->lazy_body != -1) {
+        reach_lazy_body(out);
+    }
     return out;
 }
 
@@ -173,7 +201,7 @@ token *_expect_peek(int n, ...) {
 
 variable *parse_type() {
     debug(0, "parse_type()\n");
-    variable *output = create_variable();
+    variable *output = create_variable(&parser_region);
     token *tok = tokenizer_peek();
     while(
         tok->type == TOK_UNSIGNED ||
@@ -242,484 +270,436 @@ void parse_arg_definition(varlist *arglist) {
     }
 }
 
-int precedence(token *tok, int prefix_postfix) {
-    switch(tok->type) {
-        case TOK_LPAREN:
-        case TOK_RPAREN:
-        case TOK_LSQUARE:
-        case TOK_RSQUARE:
-        case TOK_DOT:
-        case TOK_ARROW:
-            return 1;
-        case TOK_NOT:
-        case TOK_BITWISE_NOT:
-        case TOK_SIZEOF:
-            return 2;
-        case TOK_DIVIDE:
-        case TOK_MOD:
-            return 3;
-        case TOK_LSH:
-        case TOK_RSH:
-            return 5;
-        case TOK_LESS:
-        case TOK_MORE:
-        case TOK_LESS_EQUAL:
-        case TOK_MORE_EQUAL:
-            return 6;
-        case TOK_EQUAL_TO:
-        case TOK_NOT_EQUAL:
-            return 7;
-        case TOK_XOR:
-            return 9;
-        case TOK_BITWISE_OR:
-            return 10;
-        case TOK_AND:
-            return 11;
-        case TOK_OR:
-            return 12;
-        case TOK_QUESTION_MARK:
-        case TOK_COLON:
-            return 13;
-        case TOK_EQUAL:
-        case TOK_PLUS_EQUAL:
-        case TOK_MINUS_EQUAL:
-        case TOK_TIMES_EQUAL:
-        case TOK_DIVIDE_EQUAL:
-        case TOK_MOD_EQUAL:
-        case TOK_AND_EQUAL:
-        case TOK_OR_EQUAL:
-        case TOK_XOR_EQUAL:
-        case TOK_LSHIFT_EQUAL:
-        case TOK_RSHIFT_EQUAL:
-            return 14;
-        case TOK_COMMA:
-            return 15;
-        case TOK_POSTFIX_INCREMENT:
-        case TOK_POSTFIX_DECREMENT:
-            return 1;
-        case TOK_PREFIX_INCREMENT:
-        case TOK_PREFIX_DECREMENT:
-            return 2;
-        case TOK_MULTIPLY:
-            return 3;
-        case TOK_POINTER:
-            return 2;
-        case TOK_BITWISE_AND:
-            return 8;
-        case TOK_ADDRESS:
-            return 2;
-        case TOK_POSITIVE:
-            return 4;
-        case TOK_ADD:
-            return 2;
-        case TOK_NEGATIVE:
-            return 4;
-        case TOK_SUBTRACT:
-            return 2;
-        /*case TOK_INCREMENT:
-        case TOK_DECREMENT:
-            if(prefix_postfix == -1) {
-                return 1;
-            } else {
-                return 2;
-            }
-        case TOK_STAR:
-            if(prefix_postfix == 0) {
-                return 3;
-            } else {
-                return 2;
-            }
-        case TOK_AMPERSAND:
-            if(prefix_postfix == 0) {
-                return 8;
-            } else {
-                return 2;
-            }
-        case TOK_PLUS:
-        case TOK_MINUS:
-            if(prefix_postfix == 0) {
-                return 4;
-            } else {
-                return 2;
-            }*/
-    }
-    // should never get here
-    error(tok, "Strange operator: %s\n", get_string_from_toktype(tok->type));
-}
+// how tightly each operator holds on to the operands either side of it,
+// higher binds tighter. Ambiguous operators are in here with their binary
+// meaning, and ++/-- with their postfix one
+enum {
+    BINDING_NONE,
+    BINDING_COMMA,
+    BINDING_ASSIGNMENT,
+    BINDING_CONDITIONAL,
+    BINDING_OR,
+    BINDING_AND,
+    BINDING_BITWISE_OR,
+    BINDING_XOR,
+    BINDING_BITWISE_AND,
+    BINDING_EQUALITY,
+    BINDING_RELATIONAL,
+    BINDING_SHIFT,
+    BINDING_ADDITIVE,
+    BINDING_MULTIPLICATIVE,
+    BINDING_PREFIX,
+    BINDING_POSTFIX
+};
 
-int is_left_associative(token *tok, int prefix_postfix) {
-    switch(tok->type) {
-        case TOK_LPAREN:
-        case TOK_RPAREN:
-        case TOK_LSQUARE:
-        case TOK_RSQUARE:
-        case TOK_DOT:
-        case TOK_ARROW:
-            return 1;
-        case TOK_NOT:
-        case TOK_BITWISE_NOT:
-        case TOK_SIZEOF:
-            return 0;
-        case TOK_DIVIDE:
-        case TOK_MOD:
-        case TOK_LSH:
-        case TOK_RSH:
-        case TOK_LESS:
-        case TOK_MORE:
-        case TOK_LESS_EQUAL:
-        case TOK_MORE_EQUAL:
-        case TOK_EQUAL_TO:
-        case TOK_NOT_EQUAL:
-        case TOK_XOR:
-        case TOK_BITWISE_OR:
-        case TOK_AND:
-        case TOK_OR:
-            return 1;
-        case TOK_QUESTION_MARK:
-        case TOK_COLON:
-        case TOK_EQUAL:
-        case TOK_PLUS_EQUAL:
-        case TOK_MINUS_EQUAL:
-        case TOK_TIMES_EQUAL:
-        case TOK_DIVIDE_EQUAL:
-        case TOK_MOD_EQUAL:
-        case TOK_AND_EQUAL:
-        case TOK_OR_EQUAL:
-        case TOK_XOR_EQUAL:
-        case TOK_LSHIFT_EQUAL:
-        case TOK_RSHIFT_EQUAL:
-            return 0;
-        case TOK_COMMA:
-            return 1;
-        case TOK_POSTFIX_INCREMENT:
-        case TOK_POSTFIX_DECREMENT:
-            return 1;
-        case TOK_PREFIX_INCREMENT:
-        case TOK_PREFIX_DECREMENT:
-            return 0;
-        case TOK_MULTIPLY:
-            return 1;
-        case TOK_POINTER:
-            return 0;
-        case TOK_BITWISE_AND:
-            return 1;
-        case TOK_ADDRESS:
-            return 0;
-        case TOK_POSITIVE:
-            return 1;
-        case TOK_ADD:
-            return 0;
-        case TOK_NEGATIVE:
-            return 1;
-        case TOK_SUBTRACT:
-            return 0;
-        /*case TOK_INCREMENT:
-        case TOK_DECREMENT:
-            if(prefix_postfix == -1) {
-                return 1;
-            } else {
-                return 0;
-            }
-        case TOK_STAR:
-            if(prefix_postfix == 0) {
-                return 1;
-            } else {
-                return 0;
-            }
-        case TOK_AMPERSAND:
-            if(prefix_postfix == 0) {
-                return 1;
-            } else {
-                return 0;
-            }
-        case TOK_PLUS:
-        case TOK_MINUS:
-            if(prefix_postfix == 0) {
-                return 1;
-            } else {
-                return 0;
-            }*/
-    }
-    // should never get here
-    error(tok, "Strange operator: %s\n", get_string_from_toktype(tok->type));
-}
+// indexed by the operator's group, from the binary operators to the
+// ambiguous ones, and its place in the group
+#define BINDING_GROUP_SIZE 64
+#define BINDING_INDEX(type) ((((type) >> 12) - 2) * BINDING_GROUP_SIZE + ((type) & 0xFFF))
 
-tree *parse_reverse_polish(opstack *stack) {
-    if(stack->start == NULL) {
-        error(tokenizer_peek(), "Bad expression\n");
-    }
-    token *first = opstack_peek_fifo(stack).value;
-    opstack *tmpstack = create_opstack();
-    while(!opstack_empty(stack)) {
-        token *tok = (token *)opstack_pop_fifo(stack).value;
-        if(is_operator(tok->type)) {
-            if(is_single_argument(tok->type)) {
-                tree *t = create_tree(TREETYPE_OPERATOR);
-                t->data.tok = tok;
-                t->left = opstack_pop(tmpstack).value;
-                opstack_push(tmpstack, t, 0);
-            } else {
-                tree *t = create_tree(TREETYPE_OPERATOR);
-                t->data.tok = tok;
-                t->right = opstack_pop(tmpstack).value;
-                t->left = opstack_pop(tmpstack).value;
-                opstack_push(tmpstack, t, 0);
-            }
-        } else if(tok->type == TOK_INT_CONST) {
-            tree *t = create_tree(TREETYPE_INTEGER);
-            t->data.int_value = tok->value;
-            opstack_push(tmpstack, t, 0);
-        } else if(tok->type == TOK_CHAR_CONST) {
-            tree *t = create_tree(TREETYPE_CHAR);
-            t->data.int_value = tok->value;
-            opstack_push(tmpstack, t, 0);
-        } else if(tok->type == TOK_STRING_CONST) {
-            tree *t = create_tree(TREETYPE_STRING);
-            t->data.string_value = strdup(tok->string);
-            opstack_push(tmpstack, t, 0);
-        } else if(tok->type == TOK_IDENTIFIER) {
-            tree *t = create_tree(TREETYPE_VARIABLE);
-            t->data.var = get_variable(tok);
-            opstack_push(tmpstack, t, 0);
-        } else {
-            error(tok, "Weird value: %d\n", tok->type);
-        }
-    }
-    if(tmpstack->start != NULL && tmpstack->start == tmpstack->end) {
-        tree *t = (tree *)opstack_pop(tmpstack).value;
-        delete_opstack(tmpstack);
-        return t;
+static const char binding_powers[3 * BINDING_GROUP_SIZE] = {
+    [BINDING_INDEX(TOK_COMMA)] = BINDING_COMMA,
+    [BINDING_INDEX(TOK_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_PLUS_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_MINUS_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_TIMES_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_DIVIDE_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_MOD_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_AND_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_OR_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_XOR_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_LSHIFT_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_RSHIFT_EQUAL)] = BINDING_ASSIGNMENT,
+    [BINDING_INDEX(TOK_QUESTION_MARK)] = BINDING_CONDITIONAL,
+    [BINDING_INDEX(TOK_OR)] = BINDING_OR,
+    [BINDING_INDEX(TOK_AND)] = BINDING_AND,
+    [BINDING_INDEX(TOK_BITWISE_OR)] = BINDING_BITWISE_OR,
+    [BINDING_INDEX(TOK_XOR)] = BINDING_XOR,
+    [BINDING_INDEX(TOK_AMPERSAND)] = BINDING_BITWISE_AND,
+    [BINDING_INDEX(TOK_EQUAL_TO)] = BINDING_EQUALITY,
+    [BINDING_INDEX(TOK_NOT_EQUAL)] = BINDING_EQUALITY,
+    [BINDING_INDEX(TOK_LESS)] = BINDING_RELATIONAL,
+    [BINDING_INDEX(TOK_MORE)] = BINDING_RELATIONAL,
+    [BINDING_INDEX(TOK_LESS_EQUAL)] = BINDING_RELATIONAL,
+    [BINDING_INDEX(TOK_MORE_EQUAL)] = BINDING_RELATIONAL,
+    [BINDING_INDEX(TOK_LSH)] = BINDING_SHIFT,
+    [BINDING_INDEX(TOK_RSH)] = BINDING_SHIFT,
+    [BINDING_INDEX(TOK_PLUS)] = BINDING_ADDITIVE,
+    [BINDING_INDEX(TOK_MINUS)] = BINDING_ADDITIVE,
+    [BINDING_INDEX(TOK_STAR)] = BINDING_MULTIPLICATIVE,
+    [BINDING_INDEX(TOK_DIVIDE)] = BINDING_MULTIPLICATIVE,
+    [BINDING_INDEX(TOK_MOD)] = BINDING_MULTIPLICATIVE,
+    [BINDING_INDEX(TOK_INCREMENT)] = BINDING_POSTFIX,
+    [BINDING_INDEX(TOK_DECREMENT)] = BINDING_POSTFIX,
+    [BINDING_INDEX(TOK_LSQUARE)] = BINDING_POSTFIX,
+    [BINDING_INDEX(TOK_DOT)] = BINDING_POSTFIX,
+    [BINDING_INDEX(TOK_ARROW)] = BINDING_POSTFIX
+};
+
+int binding_power(int type) {
+    if(type < 0x2000 || type >= 0x5000) {
+        return BINDING_NONE;
     }
-    error(first, "Bad expression\n");
+    return binding_powers[BINDING_INDEX(type)];
 }
 
-void opmod(token *tok, int prefix_postfix) {
+// the same token can be read more than once, in every expansion of a
+// macro and every include of a cached header, so an operator that depends
+// on where it is becomes a copy with its type worked out instead of
+// changing the token
+token *opmod(token *tok, int prefix_postfix) {
+    int type = tok->type;
     switch(tok->type) {
         case TOK_STAR:
             if(prefix_postfix == 0) {
-                tok->type = TOK_MULTIPLY;
+                type = TOK_MULTIPLY;
             } else if(prefix_postfix == 1) {
-                tok->type = TOK_POINTER;
+                type = TOK_POINTER;
             } else {
                 error(tok, "Error parsing token\n");
             }
             break;
         case TOK_AMPERSAND:
             if(prefix_postfix == 0) {
-                tok->type = TOK_BITWISE_AND;
+                type = TOK_BITWISE_AND;
             } else if(prefix_postfix == 1) {
-                tok->type = TOK_ADDRESS;
+                type = TOK_ADDRESS;
             } else {
                 error(tok, "Error parsing token\n");
             }
             break;
         case TOK_PLUS:
             if(prefix_postfix == 0) {
-                tok->type = TOK_ADD;
+                type = TOK_ADD;
             } else if(prefix_postfix == 1) {
-                tok->type = TOK_POSITIVE;
+                type = TOK_POSITIVE;
             } else {
                 error(tok, "Error parsing token\n");
             }
             break;
         case TOK_MINUS:
             if(prefix_postfix == 0) {
-                tok->type = TOK_SUBTRACT;
+                type = TOK_SUBTRACT;
             } else if(prefix_postfix == 1) {
-                tok->type = TOK_NEGATIVE;
+                type = TOK_NEGATIVE;
             } else {
                 error(tok, "Error parsing token\n");
             }
             break;
         case TOK_INCREMENT:
             if(prefix_postfix == -1) {
-                tok->type = TOK_POSTFIX_INCREMENT;
+                type = TOK_POSTFIX_INCREMENT;
             } else if(prefix_postfix == 1) {
-                tok->type = TOK_PREFIX_INCREMENT;
+                type = TOK_PREFIX_INCREMENT;
             } else {
                 error(tok, "Error parsing token\n");
             }
             break;
         case TOK_DECREMENT:
             if(prefix_postfix == -1) {
-                tok->type = TOK_POSTFIX_DECREMENT;
+                type = TOK_POSTFIX_DECREMENT;
             } else if(prefix_postfix == 1) {
-                tok->type = TOK_PREFIX_DECREMENT;
+                type = TOK_PREFIX_DECREMENT;
             } else {
                 error(tok, "Error parsing token\n");
             }
             break;
     }
+    if(type == tok->type) {
+        return tok;
+    }
+    token *out = region_alloc(&parser_region, sizeof(token));
+    *out = *tok;
+    out->type = type;
+    return out;
 }
 
-// TODO: actually get this working correctly...
-tree *parse_expression2(int end_type, int end_type2) {
-    debug(0, "parse_expression()\n");
-    // shunting yard
-    
-    opstack *out = create_opstack();
-    opstack *tmp = create_opstack();
-    
-    int prefix_postfix = 1;
-    
-    token *tok = tokenizer_peek();
-    while(tok->type != TOK_EOF && tok->type != end_type && tok->type != end_type2) {
-        tok = expect(
-            TOK_INT_CONST, TOK_LONG_CONST, TOK_CHAR_CONST, TOK_STRING_CONST, TOK_FLOAT_CONST, TOK_DOUBLE_CONST,
-            TOK_IDENTIFIER, TOK_EQUAL, TOK_PLUS_EQUAL, TOK_MINUS_EQUAL, TOK_TIMES_EQUAL, TOK_DIVIDE_EQUAL,
-            TOK_MOD_EQUAL, TOK_AND_EQUAL, TOK_OR_EQUAL, TOK_XOR_EQUAL, TOK_LSHIFT_EQUAL, TOK_RSHIFT_EQUAL,
-            TOK_INCREMENT, TOK_DECREMENT, TOK_DIVIDE, TOK_MOD, TOK_BITWISE_NOT, TOK_BITWISE_OR, TOK_XOR,
-            TOK_LSH, TOK_RSH, TOK_NOT, TOK_AND, TOK_OR, TOK_EQUAL_TO, TOK_NOT_EQUAL, TOK_LESS, TOK_MORE,
-            TOK_LESS_EQUAL, TOK_MORE_EQUAL, TOK_ARROW, TOK_DOT, TOK_COMMA, TOK_QUESTION_MARK,TOK_COLON,
-            TOK_PLUS, TOK_MINUS, TOK_STAR, TOK_AMPERSAND, TOK_SIZEOF, TOK_LPAREN, TOK_RPAREN,TOK_LSQUARE,
-            TOK_RSQUARE
-        );
-        if(
-            tok->type == TOK_INT_CONST || tok->type == TOK_LONG_CONST || tok->type == TOK_CHAR_CONST ||
-            tok->type == TOK_STRING_CONST || tok->type == TOK_FLOAT_CONST || tok->type == TOK_DOUBLE_CONST ||
-            tok->type == TOK_IDENTIFIER
-        ) {
-            opstack_push(out, tok, 0);
-            token *peeked = tokenizer_peek();
-            if(peeked->type == TOK_INCREMENT || peeked->type == TOK_DECREMENT) {
-                prefix_postfix = -1;
+// the tokens that end the expression being parsed, only while it isn't
+// inside parentheses or the middle of a ?:
+int expression_end;
+int expression_end2;
+
+tree parse_binding(int min_power);
+
+tree create_operator(token *tok, tree left, tree right) {
+    tree t = create_tree(TREETYPE_OPERATOR);
+    tree_data(t).tok = tok;
+    tree_set_left(t, left);
+    tree_set_right(t, right);
+    return t;
+}
+
+// a subexpression that has to be closed by a close token, where the end
+// tokens don't count
+tree parse_enclosed(int close) {
+    int end = expression_end;
+    int end2 = expression_end2;
+    expression_end = 0;
+    expression_end2 = 0;
+    tree t = parse_binding(BINDING_NONE);
+    expression_end = end;
+    expression_end2 = end2;
+    token *tok = tokenizer_get();
+    if(tok->type == TOK_EOF) {
+        error(tok, "Reached EOF while parsing expression\n");
+    } else if(tok->type != close) {
+        error(tok, "Mismatched parenthesis\n");
+    }
+    return t;
+}
+
+// an operand along with any prefix operators in front of it
+tree parse_operand() {
+    token *tok = expect(
+        TOK_INT_CONST, TOK_LONG_CONST, TOK_CHAR_CONST, TOK_STRING_CONST, TOK_FLOAT_CONST, TOK_DOUBLE_CONST,
+        TOK_IDENTIFIER, TOK_INCREMENT, TOK_DECREMENT, TOK_BITWISE_NOT, TOK_NOT, TOK_PLUS, TOK_MINUS,
+        TOK_STAR, TOK_AMPERSAND, TOK_SIZEOF, TOK_LPAREN
+    );
+    tree t;
+    switch(tok->type) {
+        case TOK_INT_CONST:
+            t = create_tree(TREETYPE_INTEGER);
+            tree_data(t).int_value = tok->value;
+            return t;
+        case TOK_CHAR_CONST:
+            t = create_tree(TREETYPE_CHAR);
+            tree_data(t).int_value = tok->value;
+            return t;
+        case TOK_STRING_CONST:
+            t = create_tree(TREETYPE_STRING);
+            tree_data(t).string_value = tok->string;
+            return t;
+        case TOK_IDENTIFIER:
+            t = create_tree(TREETYPE_VARIABLE);
+            tree_data(t).var = get_variable(tok);
+            return t;
+        case TOK_LPAREN:
+            return parse_enclosed(TOK_RPAREN);
+        case TOK_INCREMENT:
+        case TOK_DECREMENT:
+        case TOK_BITWISE_NOT:
+        case TOK_NOT:
+        case TOK_PLUS:
+        case TOK_MINUS:
+        case TOK_STAR:
+        case TOK_AMPERSAND:
+            tok = opmod(tok, 1);
+            return create_operator(tok, parse_binding(BINDING_PREFIX), 0);
+    }
+    error(tok, "Weird value: %d\n", tok->type);
+}
+
+// an expression made of operators binding tighter than min_power
+tree parse_binding(int min_power) {
+    tree left = parse_operand();
+    while(1) {
+        token *tok = tokenizer_peek();
+        if(tok->type == expression_end || tok->type == expression_end2) {
+            break;
+        }
+        int power = binding_power(tok->type);
+        if(power <= min_power) {
+            break;
+        }
+        tokenizer_get();
+        if(power == BINDING_POSTFIX) {
+            if(tok->type == TOK_INCREMENT || tok->type == TOK_DECREMENT) {
+                tok = opmod(tok, -1);
+                left = create_operator(tok, left, 0);
+            } else if(tok->type == TOK_LSQUARE) {
+                left = create_operator(tok, left, parse_enclosed(TOK_RSQUARE));
             } else {
-                prefix_postfix = 0;
-            }
-        } else if(tok->type == TOK_LPAREN) {
-            opstack_push(tmp, tok, prefix_postfix);
-        } else if(tok->type == TOK_RPAREN) {
-            while(!opstack_empty(tmp) && ((token *)opstack_peek(tmp).value)->type != TOK_LPAREN) {
-                opstack_link popped = opstack_pop(tmp);
-                opstack_push(out, popped.value, popped.prefix_postfix);
-            }
-            if(opstack_empty(out)) {
-                error(tok, "Mismatched parenthesis");
+                left = create_operator(tok, left, parse_operand());
             }
-            opstack_pop(tmp);
+        } else if(tok->type == TOK_QUESTION_MARK) {
+            // a ? b : c is a ? (b : c)
+            tree middle = parse_enclosed(TOK_COLON);
+            token *colon = tokenizer_last();
+            tree right = parse_binding(power - 1);
+            left = create_operator(tok, left, create_operator(colon, middle, right));
         } else {
-            if(prefix_postfix > 1) {
-                error(tok, "Error parsing token\n");
-            }
-            opmod(tok, prefix_postfix);
-            while(
-                !opstack_empty(tmp) &&
-                ((token *)opstack_peek(tmp).value)->type != TOK_LPAREN && (
-                    precedence(opstack_peek(tmp).value, opstack_peek(tmp).prefix_postfix) < precedence(tok, prefix_postfix) || (
-                        precedence(opstack_peek(tmp).value, opstack_peek(tmp).prefix_postfix) == precedence(tok, prefix_postfix) &&
-                        is_left_associative(tok, prefix_postfix)
-                    )
-                )
-            ) {
-                opstack_push(out, opstack_pop(tmp).value, 0);
-            }
-            opstack_push(tmp, tok, prefix_postfix);
-            prefix_postfix++;
+            tok = opmod(tok, 0);
+            left = create_operator(tok, left, parse_binding(power == BINDING_ASSIGNMENT ? power - 1 : power));
         }
-        tok = tokenizer_peek();
     }
+    return left;
+}
+
+// parses up to end_type or end_type2 without taking it
+tree parse_expression2(int end_type, int end_type2) {
+    debug(0, "parse_expression()\n");
+    int end = expression_end;
+    int end2 = expression_end2;
+    expression_end = end_type;
+    expression_end2 = end_type2;
+    tree expression = parse_binding(BINDING_NONE);
+    expression_end = end;
+    expression_end2 = end2;
+    token *tok = tokenizer_peek();
     if(tok->type == TOK_EOF) {
-        error(tokenizer_peek(), "Reached EOF while parsing expression\n");
-    }
-    while(!opstack_empty(tmp)) {
-        opstack_push(out, opstack_pop(tmp).value, 0);
+        error(tok, "Reached EOF while parsing expression\n");
+    } else if(tok->type != end_type && tok->type != end_type2) {
+        error(tok, "Bad expression\n");
     }
-    //tokenizer_get();
-    #ifdef PARSER_DEBUG
-        printf("Reverse Polish: ");
-        print_opstack_tokens(out);
-    #endif
-    tree *expression = parse_reverse_polish(out);
     return optimize_expression(expression);
 }
 
-tree *parse_expression(int end_type) {
-    tree *output = parse_expression2(end_type, 0);
+tree parse_expression(int end_type) {
+    tree output = parse_expression2(end_type, 0);
     // hacky
     tokenizer_get();
     return output;
 }
 
-tree *parse_while() {
+tree parse_while() {
     debug(0, "parse_while()\n");
-    tree *out = create_tree(TREETYPE_WHILE);
+    tree out = create_tree(TREETYPE_WHILE);
     expect(TOK_LPAREN);
-    out->left = parse_expression(TOK_RPAREN);
-    out->right = parse_code();
+    tree_set_left(out, parse_expression(TOK_RPAREN));
+    tree_set_right(out, parse_code());
     return out;
 }
 
-tree *parse_if() {
+tree parse_if() {
     debug(0, "parse_if()\n");
-    tree *out = create_tree(TREETYPE_IF);
+    tree out = create_tree(TREETYPE_IF);
     expect(TOK_LPAREN);
-    out->left = parse_expression(TOK_RPAREN);
-    out->right = parse_code();
+    tree_set_left(out, parse_expression(TOK_RPAREN));
+    tree_set_right(out, parse_code());
     return out;
 }
 
-tree *parse_for() {
+tree parse_for() {
     debug(0, "parse_for()\n");
-    tree *out = NULL;
+    tree out = 0;
     return out;
 }
 
-tree *parse_switch() {
+tree parse_switch() {
     debug(0, "parse_switch()\n");
-    tree *out = NULL;
+    tree out = 0;
     return out;
 }
 
 // TODO
-tree *parse_asm(token *asmtok) {
+tree parse_asm(token *asmtok) {
     debug(0, "parse_asm()\n");
     if(tokenizer_peek()->type == TOK_SEMICOLON) {
-        return NULL;
+        return 0;
     }
-    tree *out = create_tree(TREETYPE_ASM);
-    tree *tmp = out;
+    tree out = create_tree(TREETYPE_ASM);
+    tree tmp = out;
     while(1) {
         token *tok = tokenizer_get();
-        tree *t;
+        tree t;
         if(tok->type == TOK_INT_CONST) {
             t = create_tree(TREETYPE_INTEGER);
-            t->data.int_value = tok->value;
+            tree_data(t).int_value = tok->value;
         } else if(tok->type == TOK_CHAR_CONST) {
             t = create_tree(TREETYPE_CHAR);
-            t->data.int_value = tok->value;
+            tree_data(t).int_value = tok->value;
         } else if(tok->type == TOK_IDENTIFIER) {
             variable *var = get_variable_noerror(tok);
             if(var == NULL) {
                 t = create_tree(TREETYPE_IDENTIFIER);
-                t->data.string_value = strdup(tok->string);
+                tree_data(t).string_value = tok->string;
             } else {
+                // a function jumped to from asm is used as much as a call
+                if(var->lazy_body != -1) {
+                    reach_lazy_body(var);
+                }
                 t = create_tree(TREETYPE_VARIABLE);
-                t->data.var = var;
+                tree_data(t).var = var;
             }
         } else if(tok->type == TOK_MOD) {
             t = create_tree(TREETYPE_IDENTIFIER);
-                t->data.string_value = "%";
+            tree_data(t).string_value = percent_string;
         } else {
             error(tok, "Unexpected token\n");
         }
-        tmp->left = t;
+        tree_set_left(tmp, t);
         if(tokenizer_peek()->type == TOK_SEMICOLON) {
             break;
         }
         if(tokenizer_peek()->type == TOK_EOF) {
             error(asmtok, "Reached EOF while parsing asm\n");
         }
-        tree *new = create_tree(TREETYPE_ASM);
-        tmp->right = new;
-        tmp = tmp->right;
+        tree new = create_tree(TREETYPE_ASM);
+        tree_set_right(tmp, new);
+        tmp = tree_right(tmp);
     }
     tokenizer_get(); // ;
     return out;
 }
 
-tree *parse_code() {
+// a block being parsed, with the last link of its statement list
+typedef struct open_block {
+    tree block;
+    tree tmp;
+    // set once it's had a statement, it can't be closed before then
+    int started;
+} open_block;
+
+DECLARE_VECTOR(open_block_list, open_block, OPEN_BLOCKS_INLINE_SIZE)
+DEFINE_VECTOR(open_block_list, open_block)
+
+// the list only gets another link when there's another statement to come
+void block_add(open_block *b, tree t) {
+    if(t != 0) {
+        tree_set_left(b->tmp, t);
+        token *peeked = tokenizer_peek();
+        if(peeked->type != TOK_RBRACE && peeked->type != TOK_EOF) {
+            tree_set_right(b->tmp, create_tree(TREETYPE_STATEMENT_LIST));
+            b->tmp = tree_right(b->tmp);
+        }
+    }
+    b->started = 1;
+}
+
+// blocks directly inside blocks are kept on a stack of their own instead
+// of being parsed by recursing, so how deeply they nest isn't limited by
+// the C stack
+tree parse_block() {
+    open_block_list open;
+    open_block_list_init(&open, NULL);
+    tree out = 0;
+    token *peeked = tokenizer_peek();
+    do {
+        if(peeked->type == TOK_LBRACE) {
+            tokenizer_get();
+            open_scope();
+            open_block b;
+            b.block = create_tree(TREETYPE_BLOCK);
+            b.tmp = b.block;
+            b.started = 0;
+            open_block_list_add(&open, b);
+        } else {
+            open_block *top = &open.items[open.length - 1];
+            if(top->started && (peeked->type == TOK_RBRACE || peeked->type == TOK_EOF)) {
+                if(peeked->type == TOK_EOF) {
+                    error(peeked, "Reached EOF while parsing block.\n");
+                }
+                close_scope();
+                tokenizer_get();
+                open.length--;
+                if(open.length == 0) {
+                    out = top->block;
+                } else {
+                    block_add(&open.items[open.length - 1], top->block);
+                }
+            } else {
+                block_add(top, parse_code());
+            }
+        }
+        peeked = tokenizer_peek();
+    } while(open.length > 0);
+    open_block_list_end(&open);
+    return out;
+}
+
+tree parse_code() {
     debug(1, "parse_code()\n");
-    tree *out = NULL;
+    tree out = 0;
     int type = tokenizer_peek()->type;
     /*token *next = expect_peek(
         TOK_WHILE, TOK_IF, TOK_FOR,
@@ -743,27 +723,32 @@ tree *parse_code() {
         tokenizer_get();
         out = parse_switch();
     } else if(next->type == TOK_IDENTIFIER) {
+        // the token after the name says which statement this is
+        int after = tokenizer_peek_n(1)->type;
         tokenizer_get();
         variable *var = get_variable(next);
-        token *next2 = expect(
-            TOK_LPAREN,
-            TOK_INCREMENT, TOK_DECREMENT,
-            TOK_EQUAL, TOK_PLUS_EQUAL, TOK_MINUS_EQUAL, TOK_TIMES_EQUAL, TOK_DIVIDE_EQUAL,
-            TOK_MOD_EQUAL, TOK_AND_EQUAL, TOK_OR_EQUAL, TOK_XOR_EQUAL, TOK_LSHIFT_EQUAL,
-            TOK_RSHIFT_EQUAL
-        );
-        if(next2->type == TOK_LPAREN) {
+        token *next2;
+        if(after == TOK_LPAREN || after == TOK_INCREMENT || after == TOK_DECREMENT) {
+            next2 = tokenizer_get();
+        } else {
+            next2 = expect(
+                TOK_EQUAL, TOK_PLUS_EQUAL, TOK_MINUS_EQUAL, TOK_TIMES_EQUAL, TOK_DIVIDE_EQUAL,
+                TOK_MOD_EQUAL, TOK_AND_EQUAL, TOK_OR_EQUAL, TOK_XOR_EQUAL, TOK_LSHIFT_EQUAL,
+                TOK_RSHIFT_EQUAL
+            );
+        }
+        if(after == TOK_LPAREN) {
             out = create_tree(TREETYPE_FUNC_CALL);
-            out->left = create_tree(TREETYPE_VARIABLE);
-            out->left->data.var = var;
-            tree *tmp = out;
+            tree_set_left(out, create_tree(TREETYPE_VARIABLE));
+            tree_data(tree_left(out)).var = var;
+            tree tmp = out;
             if(tokenizer_peek()->type != TOK_RPAREN) {
                 token *next3;
                 while(1) {
-                    tree *expression = parse_expression2(TOK_COMMA, TOK_RPAREN);
-                    tmp->right = create_tree(TREETYPE_ARG_LIST);
-                    tmp = tmp->right;
-                    tmp->left = expression;
+                    tree expression = parse_expression2(TOK_COMMA, TOK_RPAREN);
+                    tree_set_right(tmp, create_tree(TREETYPE_ARG_LIST));
+                    tmp = tree_right(tmp);
+                    tree_set_left(tmp, expression);
                     next3 = tokenizer_get();
                     if(next3->type == TOK_RPAREN || next3->type == TOK_EOF) {
                         break;
@@ -774,54 +759,27 @@ tree *parse_code() {
                 }
             }
             expect(TOK_SEMICOLON);
-        } else if(next2->type == TOK_INCREMENT) {
+        } else if(after == TOK_INCREMENT) {
             out = create_tree(TREETYPE_OPERATOR);
-            out->data.tok = next2;
-            out->left = create_tree(TREETYPE_VARIABLE);
-            out->left->data.var = var;
+            tree_data(out).tok = next2;
+            tree_set_left(out, create_tree(TREETYPE_VARIABLE));
+            tree_data(tree_left(out)).var = var;
             expect(TOK_SEMICOLON);
-        } else if(next2->type == TOK_DECREMENT) {
+        } else if(after == TOK_DECREMENT) {
             out = create_tree(TREETYPE_OPERATOR);
-            out->data.tok = next2;
-            out->left = create_tree(TREETYPE_VARIABLE);
-            out->left->data.var = var;
+            tree_data(out).tok = next2;
+            tree_set_left(out, create_tree(TREETYPE_VARIABLE));
+            tree_data(tree_left(out)).var = var;
             expect(TOK_SEMICOLON);
         } else {
             out = create_tree(TREETYPE_ASSIGN);
-            out->data.tok = next2;
-            out->left = create_tree(TREETYPE_VARIABLE);
-            out->left->data.var = var;
-            out->right = parse_expression(TOK_SEMICOLON);
+            tree_data(out).tok = next2;
+            tree_set_left(out, create_tree(TREETYPE_VARIABLE));
+            tree_data(tree_left(out)).var = var;
+            tree_set_right(out, parse_expression(TOK_SEMICOLON));
         }
     } else if(next->type == TOK_LBRACE) {
-        tokenizer_get();
-        current_scope++;
-        out = create_tree(TREETYPE_BLOCK);
-        tree *tmp = out;
-        token *peeked = tokenizer_peek();
-        while(1) {
-            tree *t = parse_code();
-            if(t != NULL) {
-                tmp->left = t;
-                peeked = tokenizer_peek();
-                if(peeked->type == TOK_RBRACE || peeked->type == TOK_EOF) {
-                    break;
-                }
-                tmp->right = create_tree(TREETYPE_STATEMENT_LIST);
-                tmp = tmp->right;
-            } else {
-                peeked = tokenizer_peek();
-                if(peeked->type == TOK_RBRACE || peeked->type == TOK_EOF) {
-                    break;
-                }
-            }
-        }
-        if(peeked->type == TOK_EOF) {
-            error(peeked, "Reached EOF while parsing block.\n");
-        }
-        clear_current_scope();
-        current_scope--;
-        tokenizer_get();
+        out = parse_block();
     } else if(next->type == TOK_ASM) {
         tokenizer_get();
         out = parse_asm(next);
@@ -840,37 +798,113 @@ tree *parse_code() {
             var->name = name->string;
             add_variable(var);
             out = create_tree(TREETYPE_DEFINE);
-            out->left = create_tree(TREETYPE_VARIABLE);
-            out->left->data.var = var;
+            tree_set_left(out, create_tree(TREETYPE_VARIABLE));
+            tree_data(tree_left(out)).var = var;
         } else {
             var->name = name->string;
             add_variable(var);
             out = create_tree(TREETYPE_DEFINE);
-            out->left = create_tree(TREETYPE_VARIABLE);
-            out->left->data.var = var;
-            out->right = create_tree(TREETYPE_ASSIGN);
-            out->right->left = create_tree(TREETYPE_VARIABLE);
-            out->right->left->data.var = var;
-            out->right->right = parse_expression(TOK_SEMICOLON);
+            tree_set_left(out, create_tree(TREETYPE_VARIABLE));
+            tree_data(tree_left(out)).var = var;
+            tree_set_right(out, create_tree(TREETYPE_ASSIGN));
+            tree_set_left(tree_right(out), create_tree(TREETYPE_VARIABLE));
+            tree_data(tree_left(tree_right(out))).var = var;
+            tree_set_right(tree_right(out), parse_expression(TOK_SEMICOLON));
         }
     }
     return out;
 }
 
-tree *parse_declaration() {
+// records a function's body to be parsed later, if it's reached
+void skip_body(variable *var, tree definition) {
+    lazy_body body;
+    body.var = var;
+    body.definition = definition;
+    body.start = lazy_tokens.length;
+    body.visible = visible_vars->scopes[visible_vars->depth - 1];
+    body.scope_level = current_scope;
+    body.reached = 0;
+    body.next = -1;
+    int depth = 0;
+    do {
+        token *tok = tokenizer_get();
+        if(tok->type == TOK_EOF) {
+            error(tok, "Reached EOF while parsing block.\n");
+        } else if(tok->type == TOK_LBRACE) {
+            depth++;
+        } else if(tok->type == TOK_RBRACE) {
+            depth--;
+        }
+        toklist_add(&lazy_tokens, tok);
+    } while(depth > 0);
+    body.length = lazy_tokens.length - body.start;
+    var->lazy_body = lazy_bodies.length;
+    lazy_body_list_add(&lazy_bodies, body);
+}
+
+void reach_lazy_body(variable *var) {
+    lazy_body *body = &lazy_bodies.items[var->lazy_body];
+    if(!body->reached) {
+        body->reached = 1;
+        body->next = lazy_pending;
+        lazy_pending = var->lazy_body;
+    }
+}
+
+// parses the skipped bodies main and interrupt lead to, names in them are
+// looked up among what was declared before each body, as they would be
+// if it hadn't been skipped
+void parse_lazy_bodies() {
+    char *roots[] = {main_string, interrupt_string};
+    int i;
+    for(i = 0; i < 2; i++) {
+        variable *var = scope_table_get(visible_vars, roots[i]);
+        if(var != NULL && var->lazy_body != -1) {
+            reach_lazy_body(var);
+        }
+    }
+    // the whole file is in sight to start with
+    int end = visible_vars->log_length;
+    int visible = end;
+    while(lazy_pending != -1) {
+        lazy_body *body = &lazy_bodies.items[lazy_pending];
+        lazy_pending = body->next;
+        variable *var = body->var;
+        tree definition = body->definition;
+        scope_table_seek(visible_vars, visible, body->visible);
+        visible = body->visible;
+        tokenizer_replay(lazy_tokens.items + body->start, body->length);
+        tree_type(definition) = TREETYPE_FUNCTION_DEFINITION;
+        tree var_tree = create_tree(TREETYPE_VARIABLE);
+        tree_data(var_tree).var = var;
+        tree_set_left(definition, var_tree);
+        current_scope = body->scope_level - 1;
+        open_scope();
+        for(i = 0; i < var->arguments->length; i++) {
+            scope_table_add(visible_vars, var->arguments->items[i]);
+        }
+        tree_set_right(definition, parse_code());
+        close_scope();
+        tokenizer_replay_end();
+    }
+    scope_table_seek(visible_vars, visible, end);
+    current_scope = 0;
+}
+
+tree parse_declaration() {
     debug(0, "parse_declaration()\n");
-    tree *out = NULL;
+    tree out = 0;
     variable *var = parse_type();
     token *name = expect(TOK_IDENTIFIER);
     var->name = name->string;
     add_variable(var);
     token *peeked = expect(TOK_LPAREN, TOK_SEMICOLON, TOK_EQUAL);
     if(peeked->type == TOK_LPAREN) { // function definition
-        current_scope++;
+        open_scope();
         out = create_tree(TREETYPE_FUNCTION_DEFINITION);
         var->is_function = 1;
         var->is_constant = 1;
-        varlist *arglist = create_varlist();
+        varlist *arglist = create_varlist(&parser_region);
         token *next = tokenizer_peek();
         if(next->type == TOK_RPAREN) {
             tokenizer_get();
@@ -878,12 +912,17 @@ tree *parse_declaration() {
             parse_arg_definition(arglist);
         }
         var->arguments = arglist;
-        tree *var_tree = create_tree(TREETYPE_VARIABLE);
-        var_tree->data.var = var;
-        out->left = var_tree;
-        out->right = parse_code();
-        clear_current_scope();
-        current_scope--;
+        if(parser_lazy_bodies && tokenizer_peek()->type == TOK_LBRACE) {
+            // nothing until it's reached
+            tree_type(out) = TREETYPE_NULL;
+            skip_body(var, out);
+        } else {
+            tree var_tree = create_tree(TREETYPE_VARIABLE);
+            tree_data(var_tree).var = var;
+            tree_set_left(out, var_tree);
+            tree_set_right(out, parse_code());
+        }
+        close_scope();
     } else if(peeked->type == TOK_SEMICOLON) { // definition
         out = create_tree(TREETYPE_NULL); // TODO
     } else { // asignment definition
@@ -892,24 +931,50 @@ tree *parse_declaration() {
     return out;
 }
 
-tree *parse_declaration_list() {
+tree parse_declaration_list() {
     debug(0, "parse_declaration_list()\n");
-    tree *out = create_tree(TREETYPE_DECLARATION_LIST);
-    out->left = parse_declaration();
-    token *tok = tokenizer_peek();
-    if(tok->type != TOK_EOF) {
-        out->right = parse_declaration_list();
-        tok = tokenizer_peek();
+    tree out = create_tree(TREETYPE_DECLARATION_LIST);
+    tree tmp = out;
+    tree_set_left(tmp, parse_declaration());
+    while(tokenizer_peek()->type != TOK_EOF) {
+        tree_set_right(tmp, create_tree(TREETYPE_DECLARATION_LIST));
+        tmp = tree_right(tmp);
+        tree_set_left(tmp, parse_declaration());
     }
     return out;
 }
 
-tree *parse() {
-    debug(0, "parse()\n");
-    all_vars = create_varlist();
-    local_vars = create_varlist();
+void init_parser() {
+    // interned before the first token is asked for, the lexer may be
+    // interning on its own thread after that
+    percent_string = intern_string("%", 1);
+    main_string = intern_string("main", 4);
+    interrupt_string = intern_string("interrupt", 9);
+    region_init(&parser_region);
+    all_vars = create_varlist(&parser_region);
+    visible_vars = create_scope_table();
     current_scope = 0;
-    tree *AST = parse_declaration_list();
+    current_ast = create_tree_pool();
+    lazy_body_list_init(&lazy_bodies, NULL);
+    toklist_init(&lazy_tokens, NULL);
+    lazy_pending = -1;
+}
+
+void end_parser() {
+    delete_tree_pool(current_ast);
+    current_ast = NULL;
+    region_end(&parser_region);
+    all_vars = NULL;
+    lazy_body_list_end(&lazy_bodies);
+    toklist_end(&lazy_tokens);
+}
+
+tree parse() {
+    debug(0, "parse()\n");
+    tree AST = parse_declaration_list();
+    if(parser_lazy_bodies) {
+        parse_lazy_bodies();
+    }
     #ifdef PARSER_DEBUG
         printf("ALL VARIABLES:\n");
         print_varlist(all_vars);
@@ -920,22 +985,57 @@ tree *parse() {
     return AST;
 }
 
-tree *create_tree(int type) {
-    tree *out = malloc(sizeof(tree));
-    out->type = type;
-    out->left = NULL;
-    out->right = NULL;
-    return out;
+DEFINE_VECTOR(tree_list, tree)
+
+tree_pool *create_tree_pool() {
+    tree_pool *pool = malloc(sizeof(tree_pool));
+    pool->capacity = TREE_POOL_START_SIZE;
+    pool->types = malloc(pool->capacity * sizeof(unsigned char));
+    pool->data = malloc(pool->capacity * sizeof(tree_data));
+    pool->lefts = malloc(pool->capacity * sizeof(tree));
+    pool->rights = malloc(pool->capacity * sizeof(tree));
+    // the null tree
+    pool->types[0] = TREETYPE_NULL;
+    pool->data[0].tok = NULL;
+    pool->lefts[0] = 0;
+    pool->rights[0] = 0;
+    pool->length = 1;
+    return pool;
 }
 
-void free_tree(tree *t) {
-    if(t->left != NULL) {
-        free_tree(t->left);
-    }
-    if(t->right != NULL) {
-        free_tree(t->right);
+// the whole tree goes at once, there's no walking it
+void delete_tree_pool(tree_pool *pool) {
+    free(pool->types);
+    free(pool->data);
+    free(pool->lefts);
+    free(pool->rights);
+    free(pool);
+}
+
+tree create_tree(int type) {
+    tree_pool *pool = current_ast;
+    if(pool->length == pool->capacity) {
+        pool->capacity *= 2;
+        pool->types = realloc(pool->types, pool->capacity * sizeof(unsigned char));
+        pool->data = realloc(pool->data, pool->capacity * sizeof(tree_data));
+        pool->lefts = realloc(pool->lefts, pool->capacity * sizeof(tree));
+        pool->rights = realloc(pool->rights, pool->capacity * sizeof(tree));
     }
-    free(t);
+    tree out = pool->length;
+    pool->length++;
+    pool->types[out] = type;
+    pool->data[out].tok = NULL;
+    pool->lefts[out] = 0;
+    pool->rights[out] = 0;
+    return out;
+}
+
+void tree_set_left(tree t, tree left) {
+    tree_left(t) = left;
+}
+
+void tree_set_right(tree t, tree right) {
+    tree_right(t) = right;
 }
 
 char *get_treetype_name(int type) {
@@ -982,43 +1082,56 @@ char *get_treetype_name(int type) {
     return "(unknown)";
 }
 
-void print_treetype(tree *t) {
-    if(t->type == TREETYPE_INTEGER) {
-        printf("\x1b[94;1m%d\x1b[0m", t->data.int_value);
-    } else if(t->type == TREETYPE_STRING) {
-        printf("\x1b[94;1m\"%s\"\x1b[0m", t->data.string_value);
-    } else if(t->type == TREETYPE_VARIABLE) {
-        printf("\x1b[95;1m%s\x1b[0m", t->data.var->name);
-    } else if(t->type == TREETYPE_IDENTIFIER) {
-        printf("\x1b[94;1m\"%s\"\x1b[0m", t->data.string_value);
-    } else if(t->type == TREETYPE_OPERATOR) {
-        printf("\x1b[94;1m%s\x1b[0m", get_string_from_toktype(t->data.tok->type));
+void print_treetype(tree t) {
+    if(tree_type(t) == TREETYPE_INTEGER) {
+        printf("\x1b[94;1m%d\x1b[0m", tree_data(t).int_value);
+    } else if(tree_type(t) == TREETYPE_STRING) {
+        printf("\x1b[94;1m\"%s\"\x1b[0m", tree_data(t).string_value);
+    } else if(tree_type(t) == TREETYPE_VARIABLE) {
+        printf("\x1b[95;1m%s\x1b[0m", tree_data(t).var->name);
+    } else if(tree_type(t) == TREETYPE_IDENTIFIER) {
+        printf("\x1b[94;1m\"%s\"\x1b[0m", tree_data(t).string_value);
+    } else if(tree_type(t) == TREETYPE_OPERATOR) {
+        printf("\x1b[94;1m%s\x1b[0m", get_string_from_toktype(tree_data(t).tok->type));
     } else {
-        printf("\x1b[92;1m%s\x1b[0m", get_treetype_name(t->type));
+        printf("\x1b[92;1m%s\x1b[0m", get_treetype_name(tree_type(t)));
     }
 }
 
-void print_tree2(tree *t, int indent) {
-    if(!t->left && !t->right) {
-        print_treetype(t);
-        printf("\n");
-    } else {
+// right children are followed in a loop rather than recursed into, lists
+// are chained down them and can be as long as the file. The nodes they
+// open are all closed at the end
+void print_tree2(tree t, int indent) {
+    int open = 0;
+    while(1) {
         print_treetype(t);
+        if(!tree_left(t) && !tree_right(t)) {
+            printf("\n");
+            break;
+        }
         printf(" {\n");
-        if(t->left == NULL) {
+        if(tree_left(t) == 0) {
             printf("%*sleft = \x1b[91;1mNULL\x1b[0m\n", indent + 2, "");
         } else {
             printf("%*sleft = ", indent + 2, "");
-            print_tree2(t->left, indent + 2);
+            print_tree2(tree_left(t), indent + 2);
         }
-        if(t->right != NULL) {
-            printf("%*sright = ", indent + 2, "");
-            print_tree2(t->right, indent + 2);
+        if(tree_right(t) == 0) {
+            printf("%*s}\n", indent, "");
+            break;
         }
+        printf("%*sright = ", indent + 2, "");
+        t = tree_right(t);
+        indent += 2;
+        open++;
+    }
+    while(open > 0) {
+        indent -= 2;
         printf("%*s}\n", indent, "");
+        open--;
     }
 }
 
-void print_tree(tree *t) {
+void print_tree(tree t) {
     print_tree2(t, 0);
 }
@@ -30,23 +30,61 @@ enum {
     TREETYPE_STRING,
 };
 
-typedef struct tree tree;
-
-struct tree {
-    int type;
-    union {
-        token *tok;
-        variable *var;
-        int int_value;
-        char *string_value;
-    } data;
-    tree *left;
-    tree *right;
-};
+// a translation unit's AST is kept in one pool as a structure of arrays,
+// and a tree is the index of its node. Node 0 is never used, it stands for
+// no tree
+typedef int tree;
+
+#define TREE_POOL_START_SIZE 1024
+
+#define LAZY_BODIES_INLINE_SIZE 16
+// how deeply blocks nest before their stacks go to the heap
+#define OPEN_BLOCKS_INLINE_SIZE 16
+#define TREE_LIST_INLINE_SIZE 16
+
+typedef union tree_data {
+    token *tok;
+    variable *var;
+    int int_value;
+    char *string_value;
+} tree_data;
+
+typedef struct tree_pool {
+    unsigned char *types;
+    tree_data *data;
+    tree *lefts;
+    tree *rights;
+    int length;
+    int capacity;
+} tree_pool;
+
+extern tree_pool *current_ast;
+
+DECLARE_VECTOR(tree_list, tree, TREE_LIST_INLINE_SIZE)
+
+// these point into arrays that move when the pool grows, so nothing that
+// creates trees can be on the right of an assignment to them, children
+// are set through tree_set_left() and tree_set_right() for that
+#define tree_type(t) (current_ast->types[t])
+#define tree_data(t) (current_ast->data[t])
+#define tree_left(t) (current_ast->lefts[t])
+#define tree_right(t) (current_ast->rights[t])
+
+tree_pool *create_tree_pool();
+void delete_tree_pool(tree_pool *pool);
+
+// with parser_lazy_bodies set, function bodies are skipped over by
+// matching braces and only parsed after the rest of the file, if main,
+// interrupt or a function they call refers to them. The ones that aren't
+// stay TREETYPE_NULL declarations and no code is generated for them.
+extern int parser_lazy_bodies;
 
-tree *parse();
-tree *create_tree(int type);
-void free_tree(tree *t);
-void print_tree(tree *t);
+void init_parser();
+void end_parser();
+tree parse();
+tree create_tree(int type);
+void tree_set_left(tree t, tree left);
+void tree_set_right(tree t, tree right);
+void print_tree(tree t);
 
 #endif
@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "pch.h"
+#include "tokenizer.h"
+
+extern varlist *all_vars;
+extern scope_table *visible_vars;
+extern region parser_region;
+
+// the records of one section of the file, appended as they're found
+typedef struct pch_buffer {
+    char *data;
+    int length;
+    int capacity;
+} pch_buffer;
+
+void pch_buffer_add(pch_buffer *buffer, void *record, int size) {
+    if(buffer->length + size > buffer->capacity) {
+        buffer->capacity = buffer->capacity == 0 ? 4096 : buffer->capacity * 2;
+        while(buffer->length + size > buffer->capacity) {
+            buffer->capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->length, record, size);
+    buffer->length += size;
+}
+
+// the index each string, token and variable was written at, open
+// addressing on the pointer
+typedef struct pointer_map {
+    void **keys;
+    int *values;
+    int size;
+    int used;
+} pointer_map;
+
+void pointer_map_init(pointer_map *map) {
+    map->size = 1024;
+    map->used = 0;
+    map->keys = calloc(map->size, sizeof(void *));
+    map->values = malloc(map->size * sizeof(int));
+}
+
+void pointer_map_end(pointer_map *map) {
+    free(map->keys);
+    free(map->values);
+}
+
+int pointer_map_slot(pointer_map *map, void *key) {
+    int i = (int)(((uintptr_t)key >> 3) * 2654435761u) & (map->size - 1);
+    while(map->keys[i] != NULL && map->keys[i] != key) {
+        i = (i + 1) & (map->size - 1);
+    }
+    return i;
+}
+
+int pointer_map_get(pointer_map *map, void *key) {
+    int i = pointer_map_slot(map, key);
+    return map->keys[i] == NULL ? -1 : map->values[i];
+}
+
+void pointer_map_put(pointer_map *map, void *key, int value) {
+    if((map->used + 1) * 2 > map->size) {
+        void **keys = map->keys;
+        int *values = map->values;
+        int size = map->size;
+        int i;
+        map->size <<= 1;
+        map->keys = calloc(map->size, sizeof(void *));
+        map->values = malloc(map->size * sizeof(int));
+        for(i = 0; i < size; i++) {
+            if(keys[i] != NULL) {
+                int j = pointer_map_slot(map, keys[i]);
+                map->keys[j] = keys[i];
+                map->values[j] = values[i];
+            }
+        }
+        free(keys);
+        free(values);
+    }
+    int i = pointer_map_slot(map, key);
+    if(map->keys[i] == NULL) {
+        map->used++;
+    }
+    map->keys[i] = key;
+    map->values[i] = value;
+}
+
+typedef struct pch_writer {
+    pch_header header;
+    pch_buffer files;
+    pch_buffer strings;
+    pch_buffer tokens;
+    pch_buffer variables;
+    pch_buffer arguments;
+    pch_buffer visible;
+    pch_buffer trees;
+    pch_buffer macros;
+    pch_buffer macro_data;
+    pch_buffer string_data;
+    pointer_map string_ids;
+    pointer_map token_ids;
+    pointer_map variable_ids;
+    // list nodes still to be written
+    pch_buffer chain;
+} pch_writer;
+
+int pch_write_string(pch_writer *writer, char *string) {
+    if(string == NULL) {
+        return -1;
+    }
+    int id = pointer_map_get(&writer->string_ids, string);
+    if(id == -1) {
+        pch_string record;
+        record.offset = writer->string_data.length;
+        record.length = strlen(string);
+        pch_buffer_add(&writer->string_data, string, record.length);
+        pch_buffer_add(&writer->strings, &record, sizeof(record));
+        id = writer->header.string_count++;
+        pointer_map_put(&writer->string_ids, string, id);
+    }
+    return id;
+}
+
+// the stream's tokens are written in order first, after them come the
+// operators the parser made copies of
+int pch_write_token(pch_writer *writer, token *tok) {
+    if(tok == NULL) {
+        return -1;
+    }
+    int id = pointer_map_get(&writer->token_ids, tok);
+    if(id == -1) {
+        pch_token record;
+        record.type = tok->type;
+        record.value = tok->value;
+        record.string = pch_write_string(writer, tok->string);
+        record.file = tok->file;
+        record.offset = tok->offset;
+        record.length = tok->length;
+        pch_buffer_add(&writer->tokens, &record, sizeof(record));
+        id = writer->header.token_count++;
+        pointer_map_put(&writer->token_ids, tok, id);
+    }
+    return id;
+}
+
+// a list node waiting for the rest of its list to be written
+typedef struct pch_pending {
+    tree t;
+    int left;
+} pch_pending;
+
+// children are written before their parents, so loading can link each
+// tree up as soon as it's read. Lists are chained down the right, so a
+// chain is walked in a loop writing the left children, then its nodes are
+// written from the end back, which keeps long lists off the C stack
+int pch_write_tree(pch_writer *writer, tree t) {
+    int base = writer->chain.length;
+    while(t != 0) {
+        pch_pending pending;
+        pending.t = t;
+        pending.left = pch_write_tree(writer, tree_left(t));
+        pch_buffer_add(&writer->chain, &pending, sizeof(pending));
+        t = tree_right(t);
+    }
+    int right = -1;
+    while(writer->chain.length > base) {
+        writer->chain.length -= sizeof(pch_pending);
+        pch_pending pending = *(pch_pending *)(writer->chain.data + writer->chain.length);
+        t = pending.t;
+        pch_tree record;
+        record.type = tree_type(t);
+        record.left = pending.left;
+        record.right = right;
+        switch(tree_type(t)) {
+            case TREETYPE_OPERATOR:
+            case TREETYPE_ASSIGN:
+                record.data = pch_write_token(writer, tree_data(t).tok);
+                break;
+            case TREETYPE_VARIABLE:
+                record.data = pointer_map_get(&writer->variable_ids, tree_data(t).var);
+                break;
+            case TREETYPE_INTEGER:
+            case TREETYPE_CHAR:
+                record.data = tree_data(t).int_value;
+                break;
+            case TREETYPE_STRING:
+            case TREETYPE_IDENTIFIER:
+                record.data = pch_write_string(writer, tree_data(t).string_value);
+                break;
+            default:
+                record.data = 0;
+        }
+        pch_buffer_add(&writer->trees, &record, sizeof(record));
+        right = writer->header.tree_count++;
+    }
+    return right;
+}
+
+void pch_emit(char *filename, tree AST) {
+    pch_writer writer;
+    int i;
+    memset(&writer, 0, sizeof(writer));
+    pointer_map_init(&writer.string_ids);
+    pointer_map_init(&writer.token_ids);
+    pointer_map_init(&writer.variable_ids);
+    memcpy(writer.header.magic, PCH_MAGIC, 4);
+    writer.header.version = PCH_VERSION;
+    
+    for(i = 0; i < source_file_count; i++) {
+        source_file *source = source_file_get(i);
+        struct stat st;
+        pch_file record;
+        if(stat(source->filename, &st) != 0) {
+            fprintf(stderr, "%s: %s\n", source->filename, strerror(errno));
+            exit(1);
+        }
+        record.path = pch_write_string(&writer, intern_string(source->filename, strlen(source->filename)));
+        record.hash = intern_hash(source->buffer, source->length);
+        record.size = st.st_size;
+        record.mtime = st.st_mtime;
+        pch_buffer_add(&writer.files, &record, sizeof(record));
+    }
+    writer.header.file_count = source_file_count;
+    
+    for(i = 0; i < tokens.length; i++) {
+        pch_write_token(&writer, token_stream_get(&tokens, i));
+    }
+    
+    for(i = 0; i < all_vars->length; i++) {
+        pointer_map_put(&writer.variable_ids, all_vars->items[i], i);
+    }
+    for(i = 0; i < all_vars->length; i++) {
+        variable *var = all_vars->items[i];
+        pch_variable record;
+        record.name = pch_write_string(&writer, var->name);
+        record.type = var->type;
+        record.pointers = var->pointers;
+        record.address = var->address;
+        record.flags = (var->is_argument ? PCH_ARGUMENT : 0) | (var->is_function ? PCH_FUNCTION : 0)
+            | (var->is_constant ? PCH_CONSTANT : 0) | (var->is_register ? PCH_REGISTER : 0)
+            | (var->is_unsigned ? PCH_UNSIGNED : 0);
+        record.scope_level = var->scope_level;
+        record.arguments = writer.header.argument_count;
+        record.argument_count = -1;
+        if(var->arguments != NULL) {
+            int j;
+            record.argument_count = var->arguments->length;
+            for(j = 0; j < var->arguments->length; j++) {
+                int id = pointer_map_get(&writer.variable_ids, var->arguments->items[j]);
+                pch_buffer_add(&writer.arguments, &id, sizeof(int));
+            }
+            writer.header.argument_count += var->arguments->length;
+        }
+        pch_buffer_add(&writer.variables, &record, sizeof(record));
+    }
+    writer.header.variable_count = all_vars->length;
+    
+    // what's still in scope after the header, its globals, in the order
+    // they were declared
+    for(i = 0; i < visible_vars->log_length; i++) {
+        int id = pointer_map_get(&writer.variable_ids, visible_vars->log[i].var);
+        pch_buffer_add(&writer.visible, &id, sizeof(int));
+    }
+    writer.header.visible_count = visible_vars->log_length;
+    
+    writer.header.root = pch_write_tree(&writer, AST);
+    
+    for(i = 0; i < macro_table_size; i++) {
+        macro *m = macro_table[i];
+        pch_macro record;
+        int j;
+        if(m == NULL || !m->defined) {
+            continue;
+        }
+        record.name = pch_write_string(&writer, m->name);
+        record.function_like = m->function_like;
+        record.parameters = writer.header.macro_data_count;
+        record.parameter_count = m->parameter_count;
+        for(j = 0; j < m->parameter_count; j++) {
+            int id = pch_write_string(&writer, m->parameters[j]);
+            pch_buffer_add(&writer.macro_data, &id, sizeof(int));
+        }
+        record.body = record.parameters + m->parameter_count;
+        record.body_length = m->body_length;
+        for(j = 0; j < m->body_length; j++) {
+            int id = pointer_map_get(&writer.token_ids, m->body[j]);
+            pch_buffer_add(&writer.macro_data, &id, sizeof(int));
+        }
+        writer.header.macro_data_count += m->parameter_count + m->body_length;
+        pch_buffer_add(&writer.macros, &record, sizeof(record));
+        writer.header.macro_count++;
+    }
+    writer.header.strings_size = writer.string_data.length;
+    
+    FILE *out = fopen(filename, "wb");
+    if(out == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    fwrite(&writer.header, sizeof(pch_header), 1, out);
+    pch_buffer *sections[] = {
+        &writer.files, &writer.strings, &writer.tokens, &writer.variables,
+        &writer.arguments, &writer.visible, &writer.trees, &writer.macros,
+        &writer.macro_data, &writer.string_data
+    };
+    int section_count = sizeof(sections) / sizeof(sections[0]);
+    for(i = 0; i < section_count; i++) {
+        if(sections[i]->length > 0) {
+            fwrite(sections[i]->data, 1, sections[i]->length, out);
+        }
+        free(sections[i]->data);
+    }
+    if(fclose(out) != 0) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    pointer_map_end(&writer.string_ids);
+    pointer_map_end(&writer.token_ids);
+    pointer_map_end(&writer.variable_ids);
+    free(writer.chain.data);
+}
+
+void pch_out_of_date(char *filename, char *source) {
+    printf("Error: precompiled header %s is out of date, %s has changed.\n", filename, source);
+    exit(1);
+}
+
+// the precompiled header being loaded, for errors
+char *pch_loading;
+
+void pch_corrupt() {
+    printf("Error: %s is corrupt.\n", pch_loading);
+    exit(1);
+}
+
+// an index read from the file has to be one of count records, or -1 where
+// none is allowed
+int pch_index(int index, int count, int none) {
+    if((index < 0 || index >= count) && !(none && index == -1)) {
+        pch_corrupt();
+    }
+    return index;
+}
+
+// and a range of them has to fit in the count
+void pch_range(int start, int length, int count) {
+    if(start < 0 || length < 0 || start > count - length) {
+        pch_corrupt();
+    }
+}
+
+// maps the precompiled header in and rebuilds its tokens, variables,
+// declarations and macros, the files it was built from count as included already.
+// Every index in it is checked, so a damaged file is an error instead of
+// reads out of bounds. Returns the header's declaration list.
+tree pch_load(char *filename) {
+    FILE *in = fopen(filename, "rb");
+    if(in == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    pch_loading = filename;
+    // read on its own, it's not a file the input depends on
+    source_file *pch = source_file_read(in, filename);
+    pch_header *header = (pch_header *)pch->buffer;
+    if(pch->length < (int)sizeof(pch_header) || memcmp(header->magic, PCH_MAGIC, 4) != 0 || header->version != PCH_VERSION) {
+        printf("Error: %s is not a precompiled header for this version of the compiler.\n", filename);
+        exit(1);
+    }
+    int counts[] = {
+        header->file_count, header->string_count, header->token_count,
+        header->variable_count, header->argument_count, header->visible_count,
+        header->tree_count, header->macro_count, header->macro_data_count,
+        header->strings_size
+    };
+    int i;
+    for(i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+        if(counts[i] < 0) {
+            pch_corrupt();
+        }
+    }
+    long long size = sizeof(pch_header) + header->file_count * (long long)sizeof(pch_file)
+        + header->string_count * (long long)sizeof(pch_string) + header->token_count * (long long)sizeof(pch_token)
+        + header->variable_count * (long long)sizeof(pch_variable) + header->argument_count * (long long)sizeof(int)
+        + header->visible_count * (long long)sizeof(int) + header->tree_count * (long long)sizeof(pch_tree)
+        + header->macro_count * (long long)sizeof(pch_macro) + header->macro_data_count * (long long)sizeof(int)
+        + header->strings_size;
+    if(size != pch->length) {
+        pch_corrupt();
+    }
+    pch_file *files = (pch_file *)(header + 1);
+    pch_string *strings = (pch_string *)(files + header->file_count);
+    pch_token *token_records = (pch_token *)(strings + header->string_count);
+    pch_variable *variable_records = (pch_variable *)(token_records + header->token_count);
+    int *arguments = (int *)(variable_records + header->variable_count);
+    int *visible = arguments + header->argument_count;
+    pch_tree *tree_records = (pch_tree *)(visible + header->visible_count);
+    pch_macro *macro_records = (pch_macro *)(tree_records + header->tree_count);
+    int *macro_data = (int *)(macro_records + header->macro_count);
+    char *string_data = (char *)(macro_data + header->macro_data_count);
+    
+    char **string_list = malloc(header->string_count * sizeof(char *));
+    for(i = 0; i < header->string_count; i++) {
+        pch_range(strings[i].offset, strings[i].length, header->strings_size);
+        string_list[i] = intern_string(string_data + strings[i].offset, strings[i].length);
+    }
+    
+    int *file_ids = malloc(header->file_count * sizeof(int));
+    int *file_lengths = malloc(header->file_count * sizeof(int));
+    for(i = 0; i < header->file_count; i++) {
+        char *path = string_list[pch_index(files[i].path, header->string_count, 0)];
+        struct stat st;
+        if(stat(path, &st) != 0 || st.st_size != files[i].size || st.st_mtime != files[i].mtime) {
+            pch_out_of_date(filename, path);
+        }
+        FILE *file = fopen(path, "r");
+        if(file == NULL) {
+            pch_out_of_date(filename, path);
+        }
+        source_file *source = source_file_load(file, path);
+        if(intern_hash(source->buffer, source->length) != files[i].hash) {
+            pch_out_of_date(filename, path);
+        }
+        source->once = 1;
+        file_ids[i] = source->id;
+        file_lengths[i] = source->length;
+    }
+    
+    token **token_list = malloc(header->token_count * sizeof(token *));
+    for(i = 0; i < header->token_count; i++) {
+        pch_token *record = &token_records[i];
+        token *tok = create_token(record->type);
+        tok->value = record->value;
+        tok->string = record->string == -1 ? NULL : string_list[pch_index(record->string, header->string_count, 1)];
+        tok->file = record->file == -1 ? -1 : file_ids[pch_index(record->file, header->file_count, 1)];
+        if(record->file != -1) {
+            pch_range(record->offset, record->length, file_lengths[record->file]);
+        }
+        tok->offset = record->offset;
+        tok->length = record->length;
+        token_list[i] = tok;
+    }
+    
+    variable **variable_list = malloc(header->variable_count * sizeof(variable *));
+    for(i = 0; i < header->variable_count; i++) {
+        pch_variable *record = &variable_records[i];
+        variable *var = create_variable(&parser_region);
+        var->name = record->name == -1 ? NULL : string_list[pch_index(record->name, header->string_count, 1)];
+        var->type = record->type;
+        var->pointers = record->pointers;
+        var->address = record->address;
+        var->is_argument = (record->flags & PCH_ARGUMENT) != 0;
+        var->is_function = (record->flags & PCH_FUNCTION) != 0;
+        var->is_constant = (record->flags & PCH_CONSTANT) != 0;
+        var->is_register = (record->flags & PCH_REGISTER) != 0;
+        var->is_unsigned = (record->flags & PCH_UNSIGNED) != 0;
+        var->scope_level = record->scope_level;
+        variable_list[i] = var;
+        varlist_add(all_vars, var);
+    }
+    for(i = 0; i < header->variable_count; i++) {
+        pch_variable *record = &variable_records[i];
+        if(record->argument_count != -1) {
+            int j;
+            pch_range(record->arguments, record->argument_count, header->argument_count);
+            variable_list[i]->arguments = create_varlist(&parser_region);
+            for(j = 0; j < record->argument_count; j++) {
+                varlist_add(variable_list[i]->arguments, variable_list[pch_index(arguments[record->arguments + j], header->variable_count, 0)]);
+            }
+        }
+    }
+    for(i = 0; i < header->visible_count; i++) {
+        scope_table_add(visible_vars, variable_list[pch_index(visible[i], header->variable_count, 0)]);
+    }
+    
+    // nodes are handed out in order, so record i becomes node base + i
+    tree base = current_ast->length;
+    for(i = 0; i < header->tree_count; i++) {
+        pch_tree *record = &tree_records[i];
+        tree t = create_tree(record->type);
+        tree_left(t) = record->left == -1 ? 0 : base + pch_index(record->left, header->tree_count, 1);
+        tree_right(t) = record->right == -1 ? 0 : base + pch_index(record->right, header->tree_count, 1);
+        switch(record->type) {
+            case TREETYPE_OPERATOR:
+            case TREETYPE_ASSIGN:
+                tree_data(t).tok = record->data == -1 ? NULL : token_list[pch_index(record->data, header->token_count, 1)];
+                break;
+            case TREETYPE_VARIABLE:
+                tree_data(t).var = variable_list[pch_index(record->data, header->variable_count, 0)];
+                break;
+            case TREETYPE_INTEGER:
+            case TREETYPE_CHAR:
+                tree_data(t).int_value = record->data;
+                break;
+            case TREETYPE_STRING:
+            case TREETYPE_IDENTIFIER:
+                tree_data(t).string_value = string_list[pch_index(record->data, header->string_count, 0)];
+                break;
+        }
+    }
+    tree root = header->root == -1 ? 0 : base + pch_index(header->root, header->tree_count, 1);
+    
+    for(i = 0; i < header->macro_count; i++) {
+        pch_macro *record = &macro_records[i];
+        macro *m = macro_define(string_list[pch_index(record->name, header->string_count, 0)]);
+        int j;
+        pch_range(record->parameters, record->parameter_count, header->macro_data_count);
+        pch_range(record->body, record->body_length, header->macro_data_count);
+        m->function_like = record->function_like;
+        m->parameter_count = record->parameter_count;
+        m->parameters = malloc(record->parameter_count * sizeof(char *));
+        for(j = 0; j < record->parameter_count; j++) {
+            m->parameters[j] = string_list[pch_index(macro_data[record->parameters + j], header->string_count, 0)];
+        }
+        m->body_length = record->body_length;
+        m->body = malloc(record->body_length * sizeof(token *));
+        for(j = 0; j < record->body_length; j++) {
+            m->body[j] = token_list[pch_index(macro_data[record->body + j], header->token_count, 0)];
+        }
+    }
+    
+    free(string_list);
+    free(file_ids);
+    free(file_lengths);
+    free(token_list);
+    free(variable_list);
+    source_file_delete(pch);
+    return root;
+}
@@ -0,0 +1,99 @@
+#ifndef PCH_H
+#define PCH_H
+
+#include "parser.h"
+
+// precompiled headers hold everything parsing a header produces, its
+// tokens, variables and declarations, as flat records that are mapped in
+// and linked back up instead of lexing and parsing the header again
+
+#define PCH_MAGIC "SPCH"
+#define PCH_VERSION 2
+
+// 56 bytes, keeping the file records after it 8 byte aligned
+typedef struct pch_header {
+    char magic[4];
+    int version;
+    int file_count;
+    int string_count;
+    int token_count;
+    int variable_count;
+    int argument_count;
+    int visible_count;
+    int tree_count;
+    int macro_count;
+    int macro_data_count;
+    int strings_size;
+    // the header's declaration list, -1 if it declares nothing
+    int root;
+    int padding;
+} pch_header;
+
+// a file the header was built from, it has to be unchanged for the
+// precompiled header to be used
+typedef struct pch_file {
+    int path;
+    unsigned int hash;
+    long long size;
+    long long mtime;
+} pch_file;
+
+typedef struct pch_string {
+    int offset;
+    int length;
+} pch_string;
+
+// strings, files, variables and tokens are referred to by index, -1 for
+// none
+typedef struct pch_token {
+    int type;
+    int value;
+    int string;
+    int file;
+    int offset;
+    int length;
+} pch_token;
+
+enum {
+    PCH_ARGUMENT = 1,
+    PCH_FUNCTION = 2,
+    PCH_CONSTANT = 4,
+    PCH_REGISTER = 8,
+    PCH_UNSIGNED = 16
+};
+
+typedef struct pch_variable {
+    int name;
+    int type;
+    int pointers;
+    int address;
+    int flags;
+    int scope_level;
+    // a range of the argument indices, count is -1 if it has no list
+    int arguments;
+    int argument_count;
+} pch_variable;
+
+// data is a token, variable, string or number depending on the type
+typedef struct pch_tree {
+    int type;
+    int data;
+    int left;
+    int right;
+} pch_tree;
+
+// the macros defined at the end of the header, parameters are string
+// indices and the body token indices, both in the macro data
+typedef struct pch_macro {
+    int name;
+    int function_like;
+    int parameters;
+    int parameter_count;
+    int body;
+    int body_length;
+} pch_macro;
+
+void pch_emit(char *filename, tree AST);
+tree pch_load(char *filename);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "tokenizer.h"
+#include "include.h"
+
+// checks that lexing each file on 2 to 8 threads (or n with
+// --lex-threads=n) gives the same tokens as lexing it serially
+
+extern tokenizer *current_tokenizer;
+
+typedef struct lexed_token {
+    int type;
+    int value;
+    char *string;
+    char *filename;
+    int offset;
+    int length;
+} lexed_token;
+
+// lexes the whole file, copying the tokens out so they outlive
+// end_tokenizer()
+lexed_token *lex_file(char *filename, int *count) {
+    FILE *input = fopen(filename, "r");
+    if(input == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    init_tokenizer();
+    current_tokenizer = tokenizer_create(NULL, input, filename);
+    int capacity = 1024;
+    lexed_token *out = malloc(capacity * sizeof(lexed_token));
+    *count = 0;
+    while(1) {
+        token *tok = tokenizer_get();
+        if(*count == capacity) {
+            capacity *= 2;
+            out = realloc(out, capacity * sizeof(lexed_token));
+        }
+        lexed_token *copy = &out[(*count)++];
+        copy->type = tok->type;
+        copy->value = tok->value;
+        copy->string = strdup(tok->string == NULL ? "" : tok->string);
+        copy->filename = strdup(token_filename(tok));
+        copy->offset = tok->offset;
+        copy->length = tok->length;
+        if(tok->type == TOK_EOF) {
+            break;
+        }
+    }
+    end_tokenizer();
+    return out;
+}
+
+void free_lexed(lexed_token *lexed, int count) {
+    int i;
+    for(i = 0; i < count; i++) {
+        free(lexed[i].string);
+        free(lexed[i].filename);
+    }
+    free(lexed);
+}
+
+// lexes the file serially and then split into every number of chunks up to
+// threads, and checks that they all give the same tokens
+int compare_lex(char *filename, int threads) {
+    int serial_count;
+    tokenizer_threads = 1;
+    lexed_token *serial = lex_file(filename, &serial_count);
+    tokenizer_min_chunk = 1;
+    int n;
+    for(n = 2; n <= threads; n++) {
+        int parallel_count;
+        int i;
+        tokenizer_threads = n;
+        lexed_token *parallel = lex_file(filename, &parallel_count);
+        for(i = 0; i < serial_count && i < parallel_count; i++) {
+            lexed_token *a = &serial[i];
+            lexed_token *b = &parallel[i];
+            if(a->type != b->type || a->value != b->value || a->offset != b->offset || a->length != b->length
+                    || strcmp(a->string, b->string) != 0 || strcmp(a->filename, b->filename) != 0) {
+                break;
+            }
+        }
+        if(i < serial_count || i < parallel_count) {
+            printf("%s: lexing with %d threads differs from serial at token %d\n", filename, n, i);
+            return 1;
+        }
+        free_lexed(parallel, parallel_count);
+    }
+    free_lexed(serial, serial_count);
+    printf("%s: %d tokens, same with up to %d threads\n", filename, serial_count, threads);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 8;
+    int failed = 0;
+    int i;
+    // the search paths are all given before any file is lexed
+    for(i = 1; i < argc; i++) {
+        if(strncmp(argv[i], "-isystem", 8) == 0 || strncmp(argv[i], "-I", 2) == 0) {
+            int system = argv[i][1] == 'i';
+            char *directory = argv[i] + (system ? 8 : 2);
+            if(*directory == '\0') {
+                if(i + 1 == argc) {
+                    fprintf(stderr, "%s needs a directory\n", argv[i]);
+                    return 1;
+                }
+                directory = argv[++i];
+            }
+            include_add_path(directory, system);
+        } else if(strncmp(argv[i], "--lex-threads=", 14) == 0) {
+            threads = atoi(argv[i] + 14);
+        }
+    }
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-I") == 0 || strcmp(argv[i], "-isystem") == 0) {
+            i++;
+        } else if(argv[i][0] != '-') {
+            failed |= compare_lex(argv[i], threads);
+        }
+    }
+    return failed;
+}
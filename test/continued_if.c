@@ -0,0 +1,18 @@
+// #if expressions and skipped lines carried on with a backslash
+#define A 2
+#if A == 2 && \
+    A > 1
+#define B 10
+#else
+#define B 20
+#endif
+#if 0
+#define C 1 \
+#endif
+#elif A + \
+    1 == 3
+#define C 3
+#endif
+void main() {
+    register int a = B + C;
+}
@@ -0,0 +1 @@
+a = 10 - 3;
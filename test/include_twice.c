@@ -0,0 +1,9 @@
+// a header with no include guard is replayed from its token cache the
+// second time, its operators have to parse the same both times
+void main() {
+    register char *s = "ab";
+    register char c = *s;
+    register int a = 0;
+#include "include_twice.h"
+#include "include_twice.h"
+}
@@ -0,0 +1,4 @@
+c = *s;
+a = 7 - 2;
+a = 2 + 3 * 4;
+a = 1 + 2 - 3 + 4;
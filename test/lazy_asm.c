@@ -0,0 +1,7 @@
+// a function only asm refers to still has its body with --lazy-bodies
+void helper() {
+    register int a = 1;
+}
+void main() {
+    asm jmp helper;
+}
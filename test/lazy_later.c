@@ -0,0 +1,9 @@
+void g(int x) {
+    h(x);
+}
+void h(int x) {
+    register int b = x;
+}
+void main() {
+    g(1);
+}
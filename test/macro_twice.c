@@ -0,0 +1,14 @@
+// every expansion of a macro reads the same body tokens, its operators
+// have to parse the same every time
+#define SUB(x) x - 1
+#define SUM(x, y) x + y * 2
+#define DEREF(p) *p
+void main() {
+    register char *s = "ab";
+    register char c = DEREF(s);
+    register int a = SUB(5);
+    c = DEREF(s);
+    a = SUB(5);
+    a = SUM(1, 2);
+    a = SUM(3, 4);
+}
@@ -0,0 +1,11 @@
+// a backslash at the end of a line carries a directive on to the next one
+#define SCALE(x, y) \
+    x * 3 \
+    + y
+#define \
+    ONE 1
+void main() {
+    register int a = SCALE(2, ONE);
+    a = SCALE(1, \
+        2);
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# compiles every test that has an expected output, test/name.c against
+# test/name.sall, with the compiler make built, then checks lexing every
+# test on several threads against lexing it serially, and last runs the
+# 100k stress tests. A test with test/name.error instead has to fail with
+# that error. Both kinds are compiled with and without function bodies
+# being parsed lazily. Headers are found in test/include.
+cd "$(dirname "$0")/.." || exit 1
+root=$(pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+for expected in test/*.sall; do
+    name=$(basename "$expected" .sall)
+    for flag in "" --lazy-bodies; do
+        mode=${flag:-eager}
+        rm -f "$work/output.sall"
+        if ! (cd "$work" && "$root/bin/sall-cc" $flag -I "$root/test/include" "$root/test/$name.c" > "$work/stdout" 2>&1); then
+            echo "FAIL $name $mode: the compiler failed"
+            tail -n 5 "$work/stdout"
+            failed=1
+        elif ! cmp -s "$work/output.sall" "$expected"; then
+            echo "FAIL $name $mode: output differs from $expected"
+            diff "$expected" "$work/output.sall" | head -n 10
+            failed=1
+        else
+            echo "ok $name $mode"
+        fi
+    done
+done
+for expected in test/*.error; do
+    name=$(basename "$expected" .error)
+    for flag in "" --lazy-bodies; do
+        mode=${flag:-eager}
+        if (cd "$work" && "$root/bin/sall-cc" $flag -I "$root/test/include" "$root/test/$name.c" > "$work/stdout" 2>&1); then
+            echo "FAIL $name $mode: the compiler didn't fail"
+            failed=1
+        elif ! sed -e 's/\x1b\[[0-9;]*m//g' -e "s|$root/test/||" "$work/stdout" | grep 'error:' | cmp -s - "$expected"; then
+            echo "FAIL $name $mode: the error differs from $expected"
+            grep 'error:' "$work/stdout" | head -n 5
+            failed=1
+        else
+            echo "ok $name $mode"
+        fi
+    done
+done
+if ! bin/compare-lex -I test/include $(ls test/*.c | grep -v compare_lex.c); then
+    failed=1
+fi
+if ! sh test/stress.sh; then
+    failed=1
+fi
+exit $failed
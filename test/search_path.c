@@ -0,0 +1,6 @@
+// found through -I test/include, which has to still be searched when the
+// file is lexed again
+void main() {
+    register int a = 0;
+#include <search_path.h>
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# generates inputs with 100k elements, a file of functions, a statement
+# list, blocks nested inside each other and an operator chain, and checks
+# what the compiler makes of them against test/stress.expected. The
+# compiler is built without printing its AST, which for these would be
+# far too long.
+cd "$(dirname "$0")/.." || exit 1
+n=${STRESS_SIZE:-100000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+${CC:-gcc} -pthread -DNO_PRINT_AST -o "$work/sall-cc" *.c || exit 1
+
+awk -v n=$n 'BEGIN {
+    for(i = 0; i < n; i++) {
+        printf "void f%d(int x) {\n    register int a = 1;\n}\n", i;
+    }
+    printf "void main() {\n";
+    for(i = 0; i < n; i++) {
+        printf "    f%d(1);\n", i;
+    }
+    printf "}\n";
+}' > "$work/list.c"
+awk -v n=$n 'BEGIN {
+    printf "void main() {\n    register int a = 0;\n";
+    for(i = 0; i < n; i++) {
+        printf "{";
+    }
+    printf "\n    a = 1;\n";
+    for(i = 0; i < n; i++) {
+        printf "}";
+    }
+    printf "\n}\n";
+}' > "$work/nesting.c"
+awk -v n=$n 'BEGIN {
+    printf "void main() {\n    register int a = 1";
+    for(i = 1; i < n; i++) {
+        printf " + 1";
+    }
+    printf ";\n}\n";
+}' > "$work/chain.c"
+
+# labels are numbered, so they're counted rather than listed, and
+# indentation is written as how many spaces it is
+for name in list nesting chain; do
+    echo "$name:"
+    if ! (cd "$work" && ./sall-cc $name.c > stdout 2>&1); then
+        echo "the compiler failed"
+        tail -n 5 "$work/stdout"
+        continue
+    fi
+    sed 's/\(func_f\|return_f\|call_return_\)[0-9]*/\1N/g' "$work/output.sall" \
+        | awk '{ match($0, /^ */); print RLENGTH ":" substr($0, RLENGTH + 1) }' | sort | uniq -c
+done > "$work/result"
+
+if [ "$1" = "save" ]; then
+    cp "$work/result" test/stress.expected
+elif ! cmp -s "$work/result" test/stress.expected; then
+    echo "FAIL stress"
+    diff test/stress.expected "$work/result" | head -n 20
+    exit 1
+else
+    echo "ok stress"
+fi
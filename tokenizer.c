@@ -1,14 +1,66 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 
 #include "tokenizer.h"
+#include "include.h"
 
-typedef struct string_len {
-    char *string;
-    int len;
-} string_len;
+#if TOKENIZER_USE_MMAP
+    #include <sys/mman.h>
+#endif
+#if TOKENIZER_USE_MMAP || TOKENIZER_USE_FILE_IDS
+    #include <sys/stat.h>
+#endif
+#if TOKENIZER_USE_THREADS
+    #include <pthread.h>
+    #include <sched.h>
+    #include <stdatomic.h>
+#endif
+
+// runs of identifier characters and whitespace are scanned a vector at a
+// time when the target has SSE2 or AVX2
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define SCAN_WIDTH 32
+    #define SCAN_ALL 0xFFFFFFFFu
+    typedef __m256i scan_vector;
+    #define scan_load(p) _mm256_loadu_si256((__m256i *)(p))
+    #define scan_set(c) _mm256_set1_epi8(c)
+    #define scan_eq(a, b) _mm256_cmpeq_epi8(a, b)
+    #define scan_gt(a, b) _mm256_cmpgt_epi8(a, b)
+    #define scan_or(a, b) _mm256_or_si256(a, b)
+    #define scan_and(a, b) _mm256_and_si256(a, b)
+    #define scan_mask(v) ((unsigned int)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+    #define SCAN_WIDTH 16
+    #define SCAN_ALL 0xFFFFu
+    typedef __m128i scan_vector;
+    #define scan_load(p) _mm_loadu_si128((__m128i *)(p))
+    #define scan_set(c) _mm_set1_epi8(c)
+    #define scan_eq(a, b) _mm_cmpeq_epi8(a, b)
+    #define scan_gt(a, b) _mm_cmpgt_epi8(a, b)
+    #define scan_or(a, b) _mm_or_si128(a, b)
+    #define scan_and(a, b) _mm_and_si128(a, b)
+    #define scan_mask(v) ((unsigned int)_mm_movemask_epi8(v))
+#else
+    #define SCAN_WIDTH 0
+#endif
+
+// numbers are converted 8 digits at a time inside a 64 bit integer
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    #define TOKENIZER_SWAR 1
+#else
+    #define TOKENIZER_SWAR 0
+#endif
+
+enum {
+    CHAR_IDENTIFIER = 1,
+    CHAR_DIGIT = 2,
+    CHAR_BLANK = 4
+};
 
 struct {
     char *string;
@@ -45,7 +97,7 @@ struct {
     {"union", TOK_UNION},
     {"unsigned", TOK_UNSIGNED},
     {"void", TOK_VOID},
-    {"volitile", TOK_VOLATILE},
+    {"volatile", TOK_VOLATILE},
     {"while", TOK_WHILE},
     {"asm", TOK_ASM},
     
@@ -125,41 +177,242 @@ struct {
     {"[ ERROR ]", TOK_ERROR},
 };
 
-string_len multi_char_operators[] = {
-    {"++"},
-    {"--"},
-    {"->"},
-    {"<<"},
-    {">>"},
-    {"<="},
-    {">="},
-    {"=="},
-    {"!="},
-    {"&&"},
-    {"||"},
-    {"+="},
-    {"-="},
-    {"*="},
-    {"/="},
-    {"%="},
-    {"<<="},
-    {">>="},
-    {"&="},
-    {"^="},
-    {"|="},
-    {"..."}
-};
+// token names indexed by type, the high nibble of a type picks the group
+// and the low bits the entry within it
+#define TOKEN_NAME_GROUP_SIZE 64
+#define TOKEN_NAME_TABLE_SIZE (7 * TOKEN_NAME_GROUP_SIZE)
+#define TOKEN_NAME_INDEX(type) (((type) >> 12) * TOKEN_NAME_GROUP_SIZE + ((type) & 0xFFF))
+
+char *token_names[TOKEN_NAME_TABLE_SIZE];
+
+// operators are recognized by a DFA built from convert_table[] in
+// init_tokenizer(), state 0 is the start state and a transition back to it
+// means the operator can't be extended any further
+#define OPERATOR_STATES 64
 
-toklist *tokens_to_free;
+unsigned char char_classes[256];
+
+unsigned char operator_transitions[OPERATOR_STATES][256];
+int operator_accepts[OPERATOR_STATES];
+int operator_state_count;
+
+token_stream tokens;
 
 tokenizer *current_tokenizer;
 
-token *create_token(int type);
+int tokenizer_threads = 1;
+int tokenizer_min_chunk = TOKENIZER_PARALLEL_MIN_CHUNK;
+
+// tokens that have been lexed but not taken by the parser yet
+token *lookahead[TOKENIZER_LOOKAHEAD];
+int lookahead_start;
+int lookahead_count;
+token *last_token;
+
+// tokens the parser is given again by tokenizer_replay(), ended by a copy
+// of the last one as an EOF token
+token **replay_tokens;
+int replay_count;
+int replay_index;
+token replay_end;
+// the lookahead as it was before the replay
+token *saved_lookahead[TOKENIZER_LOOKAHEAD];
+int saved_lookahead_start;
+int saved_lookahead_count;
+token *saved_last_token;
+
+// how far through a file's cache is
+enum {
+    CACHE_NONE,
+    CACHE_RECORDING,
+    CACHE_DONE
+};
+
+// an include guard is an #ifndef X and #define X before anything else in
+// the file and an #endif after everything else
+enum {
+    GUARD_START,
+    GUARD_IFNDEF,
+    GUARD_INSIDE,
+    GUARD_END,
+    GUARD_NONE
+};
+
+// indexed by source_file->id
+source_file **source_files;
+int source_file_count;
+
+// source files, tokenizers and macros, all gone with end_tokenizer(). Only
+// ever used by whichever thread is running the directives.
+region tokenizer_region;
+// a directive's copy of its text, cleared after each one
+region directive_region;
+
+int tokenizer_pipeline;
+
+macro **macro_table;
+int macro_table_size;
+int macro_table_used;
+
+// macros being expanded, the innermost last
+typedef struct expansion {
+    macro *source;
+    token **tokens;
+    int count;
+    int index;
+    // the body with a function-like macro's arguments substituted in, freed
+    // along with the expansion
+    int owned;
+} expansion;
+
+expansion *expansions;
+int expansion_count;
+int expansion_capacity;
+// read after the name of a function-like macro to see if it's called
+token *pushed_back;
+// interned once so #if can tell it apart from other identifiers
+char *defined_string;
+
+#if TOKENIZER_USE_THREADS
+    // the lexer thread only writes the head and the parser only writes the
+    // tail, so the ring needs no lock
+    token *pipeline[TOKENIZER_PIPELINE_SIZE];
+    atomic_uint pipeline_head;
+    atomic_uint pipeline_tail;
+    // the head as the lexer thread sees it, ahead of the published one
+    // by up to a batch
+    unsigned int pipeline_write;
+    // set by the parser once it reaches a lexer error
+    atomic_int pipeline_error;
+    int pipeline_started;
+    int pipeline_running;
+    pthread_t pipeline_thread;
+    _Thread_local int on_lexer_thread;
+    
+    // files are added by the lexer thread while the parser looks them up
+    pthread_mutex_t source_files_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int is_identifier_char(char c) {
+    return char_classes[(unsigned char)c] & CHAR_IDENTIFIER;
+}
+
+// returns the offset of the first character at or after i that isn't an
+// identifier character
+int scan_identifier(char *buffer, int i, int length) {
+    #if SCAN_WIDTH
+        while(i + SCAN_WIDTH <= length) {
+            scan_vector c = scan_load(buffer + i);
+            scan_vector lower = scan_or(c, scan_set(0x20));
+            scan_vector letter = scan_and(scan_gt(lower, scan_set('a' - 1)), scan_gt(scan_set('z' + 1), lower));
+            scan_vector digit = scan_and(scan_gt(c, scan_set('0' - 1)), scan_gt(scan_set('9' + 1), c));
+            scan_vector underscore = scan_eq(c, scan_set('_'));
+            unsigned int stop = scan_mask(scan_or(scan_or(letter, digit), underscore)) ^ SCAN_ALL;
+            if(stop != 0) {
+                return i + __builtin_ctz(stop);
+            }
+            i += SCAN_WIDTH;
+        }
+    #endif
+    while(i < length && (char_classes[(unsigned char)buffer[i]] & CHAR_IDENTIFIER)) {
+        i++;
+    }
+    return i;
+}
+
+// same as scan_identifier() for spaces, tabs, carriage returns and newlines
+int scan_blank(char *buffer, int i, int length) {
+    #if SCAN_WIDTH
+        while(i + SCAN_WIDTH <= length) {
+            scan_vector c = scan_load(buffer + i);
+            scan_vector blank = scan_or(scan_or(scan_eq(c, scan_set(' ')), scan_eq(c, scan_set('\t'))), scan_or(scan_eq(c, scan_set('\r')), scan_eq(c, scan_set('\n'))));
+            unsigned int stop = scan_mask(blank) ^ SCAN_ALL;
+            if(stop != 0) {
+                return i + __builtin_ctz(stop);
+            }
+            i += SCAN_WIDTH;
+        }
+    #endif
+    while(i < length && (char_classes[(unsigned char)buffer[i]] & CHAR_BLANK)) {
+        i++;
+    }
+    return i;
+}
+
+// the length of the backslash and newline at i that join two lines into
+// one, or 0 if there isn't one
+int line_splice(char *buffer, int i, int length) {
+    if(buffer[i] != '\\') {
+        return 0;
+    } else if(i + 1 < length && buffer[i + 1] == '\n') {
+        return 2;
+    } else if(i + 2 < length && buffer[i + 1] == '\r' && buffer[i + 2] == '\n') {
+        return 3;
+    }
+    return 0;
+}
+
+// whether the newline at i is joined onto the next line by a backslash
+int is_spliced(char *buffer, int i) {
+    return (i >= 1 && buffer[i - 1] == '\\') || (i >= 2 && buffer[i - 1] == '\r' && buffer[i - 2] == '\\');
+}
+
+// the offset of the newline that ends the line i is on, or length, lines
+// that end in a backslash carry on onto the next one
+int line_end(char *buffer, int i, int length) {
+    while(1) {
+        char *newline = memchr(buffer + i, '\n', length - i);
+        if(newline == NULL) {
+            return length;
+        }
+        if(!is_spliced(buffer, newline - buffer)) {
+            return newline - buffer;
+        }
+        i = newline - buffer + 1;
+    }
+}
+
+// i is just past the opening /*, returns the offset just past the closing */
+int skip_block_comment(char *buffer, int i, int length) {
+    char *end = buffer + length;
+    char *p = buffer + i;
+    char *close = end;
+    while(p < end) {
+        char *star = memchr(p, '*', end - p);
+        if(star == NULL || star + 1 >= end) {
+            break;
+        }
+        if(star[1] == '/') {
+            close = star + 2;
+            break;
+        }
+        p = star + 1;
+    }
+    return close - buffer;
+}
+
+void pipeline_push(token *tok);
+void prefetch_includes(source_file *source, char *filename);
+
+// called before the lexer reports an error, on the lexer thread this waits
+// until the parser has taken every token before it, so errors come out in
+// the same order as when lexing on demand
+void tokenizer_error_barrier() {
+    #if TOKENIZER_USE_THREADS
+        if(on_lexer_thread) {
+            pipeline_push(NULL);
+            atomic_store_explicit(&pipeline_head, pipeline_write, memory_order_release);
+            while(!atomic_load(&pipeline_error)) {
+                sched_yield();
+            }
+        }
+    #endif
+}
 
-int get_char_value(char *string) {
-    int len = strlen(string);
+int get_char_value(char *string, int len) {
     if(len > 2 || (len == 2 && string[0] != '\\')) {
-        printf("Error reading char: '%s'\n", string);
+        tokenizer_error_barrier();
+        printf("Error reading char: '%.*s'\n", len, string);
         exit(1);
     } else if(len == 2) {
         switch(string[1]) {
@@ -190,6 +443,7 @@ int get_char_value(char *string) {
             case '?':
                 return '\?';
             default:
+                tokenizer_error_barrier();
                 printf("Error: Unknown escape character \'\\%c\'", string[1]);
                 exit(0);
         }
@@ -197,101 +451,513 @@ int get_char_value(char *string) {
     return string[0];
 }
 
-int to_integer(char *string) {
-    int len = strlen(string);
-    int output = 0;
+int powers_of_10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+// converts up to 8 decimal digits, or returns -1 if any of them isn't one
+int parse_digits(char *string, int len) {
+    #if TOKENIZER_SWAR
+        // pad on the left with '0's and do all 8 digits at once
+        uint64_t chunk = 0x3030303030303030ULL;
+        memcpy((char *)&chunk + 8 - len, string, len);
+        if((((chunk + 0x4646464646464646ULL) | (chunk - 0x3030303030303030ULL)) & 0x8080808080808080ULL) != 0) {
+            return -1;
+        }
+        chunk = ((chunk & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+        chunk = ((chunk & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+        return ((chunk & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+    #else
+        int output = 0;
+        int i;
+        for(i = 0; i < len; i++) {
+            if(!(char_classes[(unsigned char)string[i]] & CHAR_DIGIT)) {
+                return -1;
+            }
+            output = output * 10 + string[i] - '0';
+        }
+        return output;
+    #endif
+}
+
+int to_integer(char *string, int len) {
+    unsigned int output = 0;
     int i;
-    if(len >= 3) {
-        if(string[0] == '0' && string[1] == 'x') {
-            for(i = len - 1; i >= 0; i--) {
-                output <<= 4;
-                if(string[len - 1 - i] >= '0' && string[len - 1 - i] <= '9') {
-                    output |= string[len - 1 - i] - '0';
-                } else if(string[len - 1 - i] >= 'a' && string[len - 1 - i] <= 'f') {
-                    output |= string[len - 1 - i] - 'a' + 10;
-                } else if(string[len - 1 - i] >= 'A' && string[len - 1 - i] <= 'F') {
-                    output |= string[len - 1 - i] - 'A' + 10;
-                } else {
-                    return -1;
-                }
+    if(len >= 3 && string[0] == '0' && string[1] == 'x') {
+        for(i = 2; i < len; i++) {
+            output <<= 4;
+            if(string[i] >= '0' && string[i] <= '9') {
+                output |= string[i] - '0';
+            } else if(string[i] >= 'a' && string[i] <= 'f') {
+                output |= string[i] - 'a' + 10;
+            } else if(string[i] >= 'A' && string[i] <= 'F') {
+                output |= string[i] - 'A' + 10;
+            } else {
+                return -1;
             }
-        } else if(string[0] == '0' && string[1] == 'b') {
-            for(i = len - 1; i >= 0; i--) {
-                output <<= 1;
-                if(string[len - 1 - i] == '0' || string[len - 1 - i] == '1') {
-                    output |= string[len - 1 - i] - '0';
-                } else {
-                    return -1;
-                }
+        }
+        return output;
+    } else if(len >= 3 && string[0] == '0' && string[1] == 'b') {
+        for(i = 2; i < len; i++) {
+            output <<= 1;
+            if(string[i] == '0' || string[i] == '1') {
+                output |= string[i] - '0';
+            } else {
+                return -1;
             }
         }
+        return output;
     }
-    for(i = len - 1; i >= 0; i--) {
-        output *= 10;
-        if(string[len - 1 - i] >= '0' && string[len - 1 - i] <= '9') {
-            output += string[len - 1 - i] - '0';
-        } else {
+    while(len > 0) {
+        int n = len > 8 ? 8 : len;
+        int digits = parse_digits(string, n);
+        if(digits == -1) {
             return -1;
         }
+        output = output * powers_of_10[n] + digits;
+        string += n;
+        len -= n;
     }
     return output;
 }
 
-int can_combine_operator(char *string, int length, char new_char) {
-    int i;
-    for(i = 0; i < sizeof(multi_char_operators) / sizeof(multi_char_operators[0]); i++) {
-        string_len operator = multi_char_operators[i];
-        int len = operator.len > length ? length : operator.len;
-        if(strncmp(operator.string, string, len) == 0) {
-            if(operator.string[len] == new_char) {
-                return 1;
+void add_operator(char *string, int type) {
+    int state = 0;
+    for(; *string != '\0'; string++) {
+        unsigned char c = *string;
+        if(operator_transitions[state][c] == 0) {
+            if(operator_state_count == OPERATOR_STATES) {
+                printf("Error: too many operator states\n");
+                exit(1);
             }
+            operator_accepts[operator_state_count] = -1;
+            operator_transitions[state][c] = operator_state_count;
+            operator_state_count++;
         }
+        state = operator_transitions[state][c];
     }
-    return 0;
+    // the first spelling of an operator in convert_table[] wins
+    if(operator_accepts[state] == -1) {
+        operator_accepts[state] = type;
+    }
+}
+
+// returns the length of the longest operator at the start of string and
+// puts its type in *type, or returns 0 if there isn't one
+int match_operator(char *string, int length, int *type) {
+    int state = 0;
+    int matched = 0;
+    int i;
+    for(i = 0; i < length; i++) {
+        state = operator_transitions[state][(unsigned char)string[i]];
+        if(state == 0) {
+            break;
+        }
+        if(operator_accepts[state] != -1) {
+            matched = i + 1;
+            *type = operator_accepts[state];
+        }
+    }
+    return matched;
 }
 
 void init_tokenizer() {
     int i;
-    for(i = 0; i < sizeof(multi_char_operators) / sizeof(multi_char_operators[0]); i++) {
-        multi_char_operators[i].len = strlen(multi_char_operators[i].string);
+    for(i = 0; i < 256; i++) {
+        if((i >= 'a' && i <= 'z') || (i >= 'A' && i <= 'Z') || i == '_') {
+            char_classes[i] = CHAR_IDENTIFIER;
+        } else if(i >= '0' && i <= '9') {
+            char_classes[i] = CHAR_IDENTIFIER | CHAR_DIGIT;
+        } else if(i == ' ' || i == '\t' || i == '\r' || i == '\n') {
+            char_classes[i] = CHAR_BLANK;
+        }
+    }
+    operator_state_count = 1;
+    operator_accepts[0] = -1;
+    for(i = 0; i < sizeof(convert_table) / sizeof(convert_table[0]); i++) {
+        char *string = convert_table[i].string;
+        if(!is_identifier_char(string[0]) && strchr(string, ' ') == NULL) {
+            add_operator(string, convert_table[i].value);
+        }
     }
-    tokens_to_free = create_toklist();
+    // the first entry for a type is its name
+    for(i = sizeof(convert_table) / sizeof(convert_table[0]) - 1; i >= 0; i--) {
+        token_names[TOKEN_NAME_INDEX(convert_table[i].value)] = convert_table[i].string;
+    }
+    tokens.blocks = NULL;
+    tokens.block_count = 0;
+    tokens.length = 0;
+    lookahead_start = 0;
+    lookahead_count = 0;
+    last_token = NULL;
+    replay_tokens = NULL;
+    source_files = NULL;
+    source_file_count = 0;
+    #if TOKENIZER_USE_THREADS
+        pipeline_head = 0;
+        pipeline_tail = 0;
+        pipeline_write = 0;
+        pipeline_error = 0;
+        pipeline_started = 0;
+        pipeline_running = 0;
+    #endif
+    macro_table_size = MACRO_TABLE_START_SIZE;
+    macro_table_used = 0;
+    macro_table = calloc(macro_table_size, sizeof(macro *));
+    expansions = NULL;
+    expansion_count = 0;
+    expansion_capacity = 0;
+    pushed_back = NULL;
+    region_init(&tokenizer_region);
+    region_init(&directive_region);
+    intern_init();
+    init_include();
+    defined_string = intern_string("defined", 7);
+}
+
+void source_file_delete(source_file *source) {
+    #if TOKENIZER_USE_MMAP
+        if(source->mapped) {
+            munmap(source->buffer, source->length);
+        } else {
+            free(source->buffer);
+        }
+    #else
+        free(source->buffer);
+    #endif
+    free(source->line_starts);
+    free(source->cache);
 }
 
 void end_tokenizer() {
+    int i;
     free_tokens();
-    delete_toklist(tokens_to_free);
+    for(i = 0; i < source_file_count; i++) {
+        source_file_delete(source_files[i]);
+    }
+    free(source_files);
+    source_files = NULL;
+    source_file_count = 0;
+    for(i = 0; i < macro_table_size; i++) {
+        if(macro_table[i] != NULL) {
+            free(macro_table[i]->parameters);
+            free(macro_table[i]->body);
+        }
+    }
+    free(macro_table);
+    macro_table = NULL;
+    free(expansions);
+    expansions = NULL;
+    region_end(&tokenizer_region);
+    region_end(&directive_region);
+    end_include();
+    intern_end();
 }
 
-tokenizer *tokenizer_create(tokenizer *parent, FILE *in, char *filename_in) {
-    tokenizer *reader = malloc(sizeof(tokenizer));
+source_file *source_file_new(char *filename) {
+    source_file *source = region_alloc(&tokenizer_region, sizeof(source_file));
+    source->filename = region_strdup(&tokenizer_region, filename);
+    source->buffer = NULL;
+    source->length = 0;
+    source->mapped = 0;
+    source->line_starts = NULL;
+    source->line_count = 0;
+    source->device = 0;
+    source->inode = 0;
+    source->once = 0;
+    source->guard = NULL;
+    source->cache = NULL;
+    source->cache_count = 0;
+    source->cache_state = CACHE_NONE;
+    return source;
+}
+
+// gives the file its id
+void source_file_add(source_file *source) {
+    #if TOKENIZER_USE_THREADS
+        pthread_mutex_lock(&source_files_lock);
+    #endif
+    // grows whenever the count hits a power of 2
+    if((source_file_count & (source_file_count - 1)) == 0) {
+        source_files = realloc(source_files, (source_file_count == 0 ? 1 : source_file_count * 2) * sizeof(source_file *));
+    }
+    source->id = source_file_count;
+    source_files[source_file_count] = source;
+    source_file_count++;
+    #if TOKENIZER_USE_THREADS
+        pthread_mutex_unlock(&source_files_lock);
+    #endif
+}
+
+// maps regular files straight into memory, and reads anything else (stdin,
+// pipes) into one buffer in large chunks, so the lexer never goes through
+// stdio per character. The file isn't given an id, so it isn't one of the
+// files that were read
+source_file *source_file_read(FILE *in, char *filename) {
+    source_file *source = source_file_new(filename);
+    #if TOKENIZER_USE_FILE_IDS
+        struct stat id;
+        if(fstat(fileno(in), &id) == 0 && S_ISREG(id.st_mode)) {
+            source->device = id.st_dev;
+            source->inode = id.st_ino;
+        }
+    #endif
+    #if TOKENIZER_USE_MMAP
+        struct stat st;
+        if(fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+            if(map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                source->buffer = map;
+                source->length = st.st_size;
+                source->mapped = 1;
+            }
+        }
+    #endif
+    if(!source->mapped) {
+        int buffer_length = TOKENIZER_READ_CHUNK;
+        size_t n;
+        source->buffer = malloc(buffer_length);
+        while((n = fread(source->buffer + source->length, 1, buffer_length - source->length, in)) > 0) {
+            source->length += n;
+            if(source->length == buffer_length) {
+                buffer_length <<= 1;
+                source->buffer = realloc(source->buffer, buffer_length);
+            }
+        }
+        if(ferror(in)) {
+            tokenizer_error_barrier();
+            fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+            exit(1);
+        }
+    }
+    if(in != stdin) {
+        fclose(in);
+    }
+    return source;
+}
+
+source_file *source_file_load(FILE *in, char *filename) {
+    source_file *source = source_file_read(in, filename);
+    source_file_add(source);
+    return source;
+}
+
+// loads a file named by an #include, already read if it was prefetched
+source_file *source_file_include(char *filename) {
+    int length;
+    char *buffer = include_prefetched(filename, &length);
+    if(buffer == NULL) {
+        FILE *file = fopen(filename, "r");
+        if(file == NULL) {
+            tokenizer_error_barrier();
+            fprintf(stderr, "%s\n", strerror(errno));
+            exit(1);
+        }
+        return source_file_load(file, filename);
+    }
+    source_file *source = source_file_new(filename);
+    source->buffer = buffer;
+    source->length = length;
+    include_file_id(filename, &source->device, &source->inode);
+    source_file_add(source);
+    return source;
+}
+
+// the file already loaded from filename, if any, found without opening it
+source_file *source_file_find(char *filename) {
+    #if TOKENIZER_USE_FILE_IDS
+        unsigned long long device;
+        unsigned long long inode;
+        int i;
+        if(!include_file_id(filename, &device, &inode)) {
+            return NULL;
+        }
+        for(i = 0; i < source_file_count; i++) {
+            if(source_files[i]->inode == inode && source_files[i]->device == device && source_files[i]->inode != 0) {
+                return source_files[i];
+            }
+        }
+    #endif
+    return NULL;
+}
+
+source_file *source_file_get(int id) {
+    #if TOKENIZER_USE_THREADS
+        pthread_mutex_lock(&source_files_lock);
+        source_file *source = source_files[id];
+        pthread_mutex_unlock(&source_files_lock);
+        return source;
+    #else
+        return source_files[id];
+    #endif
+}
+
+// a path in a make rule, with spaces and $ escaped
+void write_dependency_path(FILE *out, char *path) {
+    for(; *path != '\0'; path++) {
+        if(*path == ' ' || *path == '\t' || *path == '#') {
+            fputc('\\', out);
+        } else if(*path == '$') {
+            fputc('$', out);
+        }
+        fputc(*path, out);
+    }
+}
+
+void write_dependencies(char *filename, char *target, source_file *input, int phony) {
+    FILE *out = fopen(filename, "w");
+    int i;
+    if(out == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    write_dependency_path(out, target);
+    fprintf(out, ":");
+    for(i = 0; i < source_file_count; i++) {
+        // the input when it was read from stdin
+        if(strcmp(source_files[i]->filename, "stdin") != 0) {
+            fprintf(out, " \\\n ");
+            write_dependency_path(out, source_files[i]->filename);
+        }
+    }
+    fprintf(out, "\n");
+    for(i = 0; phony && i < source_file_count; i++) {
+        if(source_files[i] == input) {
+            continue;
+        }
+        fprintf(out, "\n");
+        write_dependency_path(out, source_files[i]->filename);
+        fprintf(out, ":\n");
+    }
+    fclose(out);
+}
+
+tokenizer *tokenizer_open(tokenizer *parent, source_file *source, char *filename_in) {
+    tokenizer *reader = region_alloc(&tokenizer_region, sizeof(tokenizer));
     reader->parent = parent;
-    reader->file = in;
-    reader->filename = strdup(filename_in);
-    string_builder_init(&reader->tok);
-    string_builder_init(&reader->current_line);
-    reader->type = -1;
-    reader->ptype = -1;
-    reader->c = ' ';
-    reader->line_num = 0;
-    reader->peeked = 0;
-    reader->newline_found = 1;
-    reader->line_offset = 0;
+    reader->source = source;
+    reader->filename = region_strdup(&tokenizer_region, filename_in);
+    reader->offset = 0;
     reader->output = NULL;
+    reader->raw = NULL;
+    reader->raw_count = 0;
+    reader->raw_index = 0;
+    reader->replaying = 0;
+    reader->from_cache = source->cache_state == CACHE_DONE;
+    reader->cache_index = 0;
+    // only headers are worth caching
+    reader->recording = parent != NULL && source->cache_state == CACHE_NONE;
+    if(reader->recording) {
+        source->cache_state = CACHE_RECORDING;
+    }
+    reader->limit = 0;
+    reader->guard_state = GUARD_START;
+    reader->guard_name = NULL;
+    reader->conditionals = NULL;
+    reader->conditional_count = 0;
+    return reader;
+}
+
+// for a file that's just been loaded
+tokenizer *tokenizer_start(tokenizer *parent, source_file *source, char *filename_in) {
+    tokenizer *reader = tokenizer_open(parent, source, filename_in);
+    if(include_prefetching) {
+        prefetch_includes(source, filename_in);
+    }
+    if(tokenizer_threads > 1) {
+        tokenizer_lex_parallel(reader, tokenizer_threads);
+    }
     return reader;
 }
 
+tokenizer *tokenizer_create(tokenizer *parent, FILE *in, char *filename_in) {
+    return tokenizer_start(parent, source_file_load(in, filename_in), filename_in);
+}
+
+// the source buffer stays alive for the tokens that point into it
 void tokenizer_delete(tokenizer *reader) {
-    if(reader->file != stdin) {
-        fclose(reader->file);
+    free(reader->raw);
+    free(reader->conditionals);
+}
+
+// called for every token outside the guard's own directives
+void guard_token(tokenizer *reader) {
+    if(reader->guard_state == GUARD_START || reader->guard_state == GUARD_IFNDEF || reader->guard_state == GUARD_END) {
+        reader->guard_state = GUARD_NONE;
+    }
+}
+
+// called at the end of the file
+void guard_end(tokenizer *reader) {
+    if(reader->conditional_count > 0) {
+        tokenizer_error_barrier();
+        printf("Unterminated #if in %s\n", reader->filename);
+        exit(1);
+    }
+    if(reader->guard_state == GUARD_END) {
+        reader->source->guard = reader->guard_name;
+    }
+}
+
+// whether including source again would add nothing
+int include_is_done(tokenizer *reader, source_file *source) {
+    if(source->once || (source->guard != NULL && macro_find(source->guard) != NULL)) {
+        return 1;
+    }
+    // included from inside its own guard, before the guard is known
+    for(; reader != NULL; reader = reader->parent) {
+        if(reader->source == source && reader->guard_state == GUARD_INSIDE && macro_find(reader->guard_name) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void conditional_error(char *message, char *directive) {
+    tokenizer_error_barrier();
+    printf(message, directive);
+    printf("\n");
+    exit(1);
+}
+
+void conditional_push(tokenizer *reader) {
+    if((reader->conditional_count & (reader->conditional_count - 1)) == 0) {
+        reader->conditionals = realloc(reader->conditionals, (reader->conditional_count == 0 ? 1 : reader->conditional_count * 2) * sizeof(int));
+    }
+    reader->conditionals[reader->conditional_count++] = 0;
+}
+
+// an #elif or #else of the innermost block
+void conditional_branch(tokenizer *reader, int is_else) {
+    char *directive = is_else ? "#else" : "#elif";
+    if(reader->conditional_count == 0) {
+        conditional_error("%s without #if", directive);
+    }
+    if(reader->conditionals[reader->conditional_count - 1]) {
+        conditional_error("%s after #else", directive);
+    }
+    reader->conditionals[reader->conditional_count - 1] = is_else;
+    // an include guard has no other branches
+    if(reader->conditional_count == 1 && reader->guard_state == GUARD_INSIDE) {
+        reader->guard_state = GUARD_NONE;
+    }
+}
+
+void conditional_pop(tokenizer *reader) {
+    if(reader->conditional_count == 0) {
+        conditional_error("%s without #if", "#endif");
+    }
+    reader->conditional_count--;
+    if(reader->conditional_count == 0 && reader->guard_state == GUARD_INSIDE) {
+        reader->guard_state = GUARD_END;
+    } else {
+        guard_token(reader);
     }
-    free(reader->filename);
-    string_builder_end(&reader->tok);
-    string_builder_end(&reader->current_line);
-    free(reader);
 }
 
+char *parse_define(tokenizer *reader, int start, int end);
+int evaluate_condition(tokenizer *reader, int start, int end);
+void skip_inactive(tokenizer *reader, int to_endif);
+
 char *current_macro;
 string_builder macro_tok;
 char *macro_token() {
@@ -312,290 +978,1558 @@ char *macro_token() {
     }
 }
 
-void parse_macro(tokenizer *reader, char *macro) {
-    string_builder_init(&macro_tok);
-    char *start = strdup(macro);
+void parse_macro(tokenizer *reader, char *macro, int length) {
+    string_builder_init(&macro_tok, NULL);
+    // leave room for macro_token() to terminate the last word
+    char *start = region_alloc(&directive_region, length + 2);
+    memcpy(start, macro, length);
+    start[length] = '\n';
+    start[length + 1] = '\0';
+    // lines joined by a backslash are one line split by a space
+    int i;
+    for(i = 0; i < length; i++) {
+        int splice = line_splice(start, i, length);
+        if(splice != 0) {
+            memset(start + i, ' ', splice - 1);
+        }
+    }
     current_macro = start;
     char *type = macro_token();
+    if(type == NULL) {
+        tokenizer_error_barrier();
+        printf("Empty macro\n");
+        exit(1);
+    }
     if(strcmp(type, "include") == 0) {
+        guard_token(reader);
         char *filename = macro_token();
-        if(*filename == '"' && *(filename + strlen(filename) - 1) == '"') {
-            filename = filename + 1;
-            *(filename + strlen(filename) - 1) = '\0';
-            
-            char *folder = strdup(reader->filename);
-            
-            // TODO: make this cross-platform
-            char *p = strrchr(folder, '/');
-            if(p != NULL && strlen(p) > 1) {
-                *(p + 1) = '\0';
-            }
-            
-            char *filename_full = malloc(strlen(folder) + strlen(filename) + 1);
-            strcpy(filename_full, folder);
-            strcpy(filename_full + strlen(folder), filename);
-            
-            FILE *file = fopen(filename_full, "r");
-            if(file == NULL) {
-                fprintf(stderr, "%s\n", strerror(errno));
+        int filename_length = filename == NULL ? 0 : strlen(filename);
+        if(filename_length >= 2 && ((filename[0] == '"' && filename[filename_length - 1] == '"') || (filename[0] == '<' && filename[filename_length - 1] == '>'))) {
+            filename[filename_length - 1] = '\0';
+            char *filename_full = include_resolve(filename + 1, reader->filename, filename[0] == '"');
+            if(filename_full == NULL) {
+                tokenizer_error_barrier();
+                printf("Can't find included file %s\n", filename + 1);
                 exit(1);
             }
-            current_tokenizer = tokenizer_create(reader, file, filename_full);
-            
-            free(filename_full);
             
-            free(folder);
+            source_file *known = source_file_find(filename_full);
+            if(known != NULL && include_is_done(reader, known)) {
+                // nothing to include
+            } else if(known != NULL && known->cache_state == CACHE_DONE) {
+                current_tokenizer = tokenizer_open(reader, known, filename_full);
+            } else {
+                current_tokenizer = tokenizer_start(reader, source_file_include(filename_full), filename_full);
+            }
+        } else {
+            tokenizer_error_barrier();
+            printf("#include expects \"file\" or <file>\n");
+            exit(1);
+        }
+    } else if(strcmp(type, "pragma") == 0) {
+        // other pragmas are ignored
+        char *name = macro_token();
+        if(name != NULL && strcmp(name, "once") == 0) {
+            reader->source->once = 1;
+        }
+    } else if(strcmp(type, "if") == 0 || strcmp(type, "ifdef") == 0 || strcmp(type, "ifndef") == 0) {
+        int active;
+        if(strcmp(type, "if") == 0) {
+            guard_token(reader);
+            int offset = macro - reader->source->buffer;
+            active = evaluate_condition(reader, offset + (current_macro - start), offset + length);
         } else {
-            printf("No support for < > includes in this version of the compiler.\n");
+            char *name = macro_token();
+            if(name == NULL) {
+                conditional_error("#%s needs a macro name", type);
+            }
+            name = intern_string(name, strlen(name));
+            active = (macro_find(name) != NULL) == (strcmp(type, "ifdef") == 0);
+            if(strcmp(type, "ifndef") == 0 && active && reader->guard_state == GUARD_START) {
+                reader->guard_state = GUARD_IFNDEF;
+                reader->guard_name = name;
+            } else {
+                guard_token(reader);
+            }
+        }
+        conditional_push(reader);
+        if(!active) {
+            skip_inactive(reader, 0);
+        }
+    } else if(strcmp(type, "elif") == 0 || strcmp(type, "else") == 0) {
+        // the branch before was taken, so the rest of the block isn't
+        guard_token(reader);
+        conditional_branch(reader, strcmp(type, "else") == 0);
+        skip_inactive(reader, 1);
+    } else if(strcmp(type, "endif") == 0) {
+        conditional_pop(reader);
+    } else if(strcmp(type, "define") == 0) {
+        int start = macro - reader->source->buffer;
+        char *name = parse_define(reader, start, start + length);
+        if(reader->guard_state == GUARD_IFNDEF && name == reader->guard_name) {
+            reader->guard_state = GUARD_INSIDE;
+        } else {
+            guard_token(reader);
+        }
+    } else if(strcmp(type, "undef") == 0) {
+        guard_token(reader);
+        char *name = macro_token();
+        if(name == NULL) {
+            tokenizer_error_barrier();
+            printf("#undef needs a macro name\n");
             exit(1);
         }
+        struct macro *m = macro_find(intern_string(name, strlen(name)));
+        if(m != NULL) {
+            m->defined = 0;
+        }
     } else {
+        tokenizer_error_barrier();
         printf("Unknown macro type \"%s\"\n", type);
         exit(1);
     }
-    free(start);
+    region_clear(&directive_region);
     string_builder_end(&macro_tok);
 }
 
-token *string_to_token(tokenizer *reader, char *string) {
-    if(reader->ptype == 2) {
-        if(string[0] == '"') {
-            reader->output = create_token(TOK_STRING_CONST);
-            reader->output->string = strdup(string + 1);
-        } else {
-            char value = get_char_value(string + 1);
-            reader->output = create_token(TOK_CHAR_CONST);
-            reader->output->value = value;
-        }
-    } else if(reader->ptype == 3) {
-        int i = get_toktype_from_string(string);
-        if(i == -1) {
-            printf("Unknown token: \"%s\"\n", string);
-            exit(1);
-        }
-        reader->output = create_token(i);
-    } else if(reader->ptype == 1) {
-        int number = to_integer(string);
-        if(number != -1) {
-            reader->output = create_token(TOK_INT_CONST);
-            reader->output->value = number;
-        } else {
-            int type = get_toktype_from_string(string);
-            if(type != -1) {
-                reader->output = create_token(type);
-            } else {
-                reader->output = create_token(TOK_IDENTIFIER);
-                reader->output->string = strdup(string);
-            }
-        }
+token *finish_token(tokenizer *reader, token *output, char *string, int length) {
+    reader->output = output;
+    output->file = reader->source->id;
+    output->offset = string - reader->source->buffer;
+    output->length = length;
+    return output;
+}
+
+// raw token types that never reach the parser, the errors are only
+// reported once the token is cooked, as a thread may have lexed them from
+// the wrong place
+enum {
+    RAW_DIRECTIVE = -1,
+    RAW_RESYNC = -2,
+    // text an inactive #if skipped while the file's cache was recorded
+    RAW_SKIPPED = -3,
+    RAW_UNKNOWN = -4,
+    RAW_SPLIT_STRING = -5,
+    RAW_SPLIT_CHAR = -6,
+    RAW_UNTERMINATED = -7
+};
+
+// macros have to be the first thing on their line, a line carried on from
+// the one before by a backslash doesn't start one
+int is_line_start(char *buffer, int offset) {
+    int i = offset - 1;
+    while(i >= 0 && (buffer[i] == ' ' || buffer[i] == '\t')) {
+        i--;
+    }
+    return i < 0 || (buffer[i] == '\n' && !is_spliced(buffer, i));
+}
+
+// identifiers, keywords and numbers
+void classify_word(char *string, int length, raw_token *out) {
+    int number = -1;
+    if(char_classes[(unsigned char)string[0]] & CHAR_DIGIT) {
+        number = to_integer(string, length);
+    }
+    out->value = 0;
+    if(number != -1) {
+        out->type = TOK_INT_CONST;
+        out->value = number;
     } else {
-        printf("Unknown token: \"%s\"\n", string);
-        exit(1);
+        out->type = get_toktype_from_string(string, length);
+        if(out->type == -1) {
+            out->type = TOK_IDENTIFIER;
+            out->value = intern_hash(string, length);
+        }
     }
-    toklist_add(tokens_to_free, reader->output);
-    reader->output->length = strlen(string);
-    reader->output->line_offset = reader->line_offset - reader->output->length;
-    return reader->output;
 }
 
-token *tokenizer_get2(tokenizer *reader) {
-    if(reader->peeked) {
-        reader->peeked = 0;
-        return reader->output;
+// finds the next token at or after i, skipping whitespace and comments,
+// and returns the offset just past it. It touches nothing but the buffer,
+// so several threads can lex the same file at once.
+int lex_raw_token(char *buffer, int i, int length, raw_token *out) {
+    while(i < length) {
+        char c = buffer[i];
+        if(char_classes[(unsigned char)c] & CHAR_BLANK) {
+            i = scan_blank(buffer, i + 1, length);
+        } else if(c == '/' && i + 1 < length && buffer[i + 1] == '/') {
+            char *newline = memchr(buffer + i, '\n', length - i);
+            i = newline == NULL ? length : newline - buffer;
+        } else if(c == '/' && i + 1 < length && buffer[i + 1] == '*') {
+            i = skip_block_comment(buffer, i + 2, length);
+        } else if(line_splice(buffer, i, length) != 0) {
+            i += line_splice(buffer, i, length);
+        } else {
+            break;
+        }
     }
-    if(reader->output != NULL && reader->output->type == TOK_EOF) {
-        delete_token(reader->output);
+    
+    out->offset = i;
+    out->value = 0;
+    if(i >= length) {
+        out->type = TOK_EOF;
+        out->length = 0;
+        return length;
     }
-    while(reader->c != EOF) {
-        if(reader->newline_found) {
-            reader->line_num++;
-            string_builder_clear(&reader->current_line);
-            reader->newline_found = 0;
-            reader->line_offset = 0;
-            while((reader->c = fgetc(reader->file)) != '\n' && reader->c != EOF) {
-                string_builder_add(&reader->current_line, reader->c);
+    
+    char c = buffer[i];
+    int end;
+    if(c == '#' && is_line_start(buffer, i)) {
+        end = line_end(buffer, i, length);
+        out->type = RAW_DIRECTIVE;
+    } else if(is_identifier_char(c)) {
+        end = scan_identifier(buffer, i + 1, length);
+        classify_word(buffer + i, end - i, out);
+    } else if(c == '"' || c == '\'') {
+        end = i + 1;
+        while(end < length && buffer[end] != c) {
+            if(buffer[end] == '\n') {
+                out->type = c == '"' ? RAW_SPLIT_STRING : RAW_SPLIT_CHAR;
+                out->length = end - i;
+                return end;
             }
-            if(reader->c == EOF) {
-                break;
+            if(buffer[end] == '\\' && end + 1 < length && buffer[end + 1] != '\n') {
+                end++;
             }
-            string_builder_add(&reader->current_line, reader->c);
-            //char *s = string_builder_get(&reader->current_line);
-            //printf("\"%s\"\n", s);
+            end++;
         }
-        while(reader->c != EOF) {
-            if(string_builder_get_char(&reader->current_line, reader->line_offset) == '#') {
-                parse_macro(reader, string_builder_get(&reader->current_line) + reader->line_offset + 1);
-                while(string_builder_get_char(&reader->current_line, reader->line_offset) != '\n') {
-                    reader->line_offset++;
-                }
-                reader->newline_found = 1;
-                token *peeked = tokenizer_peek();
-                return peeked;
-            } else if(string_builder_get_char(&reader->current_line, reader->line_offset) == '/' && string_builder_get_char(&reader->current_line, reader->line_offset + 1) == '/') {
-                while(string_builder_get_char(&reader->current_line, reader->line_offset) != '\n') {
-                    reader->line_offset++;
-                }
-                reader->newline_found = 1;
-                break;
-            } else if(string_builder_get_char(&reader->current_line, reader->line_offset) == '/' && string_builder_get_char(&reader->current_line, reader->line_offset + 1) == '*') {
-                reader->line_offset++;
-                while(!(string_builder_get_char(&reader->current_line, reader->line_offset - 1) == '*' && string_builder_get_char(&reader->current_line, reader->line_offset) == '/')) {
-                    if(string_builder_get_char(&reader->current_line, reader->line_offset) == '\n') {
-                        reader->line_num++;
-                        string_builder_clear(&reader->current_line);
-                        reader->line_offset = 0;
-                        while((reader->c = fgetc(reader->file)) != '\n' && reader->c != EOF) {
-                            string_builder_add(&reader->current_line, reader->c);
-                        }
-                        if(reader->c == EOF) {
-                            goto outer; // break out of both loops
-                        }
-                        string_builder_add(&reader->current_line, reader->c);
-                    }
-                    reader->line_offset++;
-                }
-                reader->line_offset++;
-                break;
-            }
-            reader->c = string_builder_get_char(&reader->current_line, reader->line_offset++);
-            if(reader->type == 2) {
-                while(reader->c != reader->ending_char && !(reader->c == EOF || reader->line_offset > reader->current_line.length)) {
-                    string_builder_add(&reader->tok, reader->c);
-                    reader->c = string_builder_get_char(&reader->current_line, reader->line_offset++);
-                }
-                if(reader->line_offset > reader->current_line.length) {
-                    if(reader->ending_char == '"') {
-                        printf("error: String is split over newline.\n");
-                    } else {
-                        printf("error: Char is split over newline.\n");
-                    }
-                    exit(1);
-                }
-                if(reader->c == EOF) {
-                    printf("Reached EOF while parsing string or char.\n");
-                    exit(1);
-                }
-                reader->c = string_builder_get_char(&reader->current_line, reader->line_offset++);
-            }
-            if(reader->c == '\n') {
-                reader->newline_found = 1;
-                if(reader->tok.length != 0) {
-                    char *string = string_builder_get(&reader->tok);
-                    token *output = string_to_token(reader, string);
-                    string_builder_clear(&reader->tok);
-                    return output;
-                } else {
-                    string_builder_clear(&reader->tok);
-                    break;
-                }
-            }
-            if(reader->c == ' ' || reader->c == '\t' || reader->c == '\n') {
-                reader->type = 0;
-            } else if((reader->c >= 'a' && reader->c <= 'z') || (reader->c >= 'A' && reader->c <= 'Z') || (reader->c >= '0' && reader->c <= '9') || reader->c == '_') {
-                reader->type = 1;
-            } else if(reader->c == '"') {
-                reader->type = 2;
-                reader->ending_char = '"';
-            } else if(reader->c == '\'') {
-                reader->type = 2;
-                reader->ending_char = '\'';
-            } else {
-                reader->type = 3;
-            }
-            if(reader->tok.length != 0 && (reader->type != reader->ptype || reader->ptype == 2 || (reader->type == 3 && !can_combine_operator(reader->tok.buffer, reader->tok.length, reader->c)))) {
-                char *string = string_builder_get(&reader->tok);
-                token *output = string_to_token(reader, string);
-                string_builder_clear(&reader->tok);
-                if(reader->type != 0) {
-                    string_builder_add(&reader->tok, reader->c);
-                    reader->ptype = reader->type;
-                }
-                return output;
-            }
-            if(reader->type != 0) {
-                string_builder_add(&reader->tok, reader->c);
-            }
-            if(reader->type != 0) {
-                reader->ptype = reader->type;
-            }
+        if(end >= length) {
+            out->type = RAW_UNTERMINATED;
+            out->length = length - i;
+            return length;
+        }
+        end++;
+        if(c == '"') {
+            out->type = TOK_STRING_CONST;
+            out->value = intern_hash(buffer + i + 1, end - i - 2);
+        } else {
+            out->type = TOK_CHAR_CONST;
         }
+    } else {
+        int matched = match_operator(buffer + i, length - i, &out->type);
+        if(matched == 0) {
+            out->type = RAW_UNKNOWN;
+            matched = 1;
+        }
+        end = i + matched;
     }
-    outer:;
-    char *string = string_builder_get(&reader->tok);
-    if(strlen(string) != 0) {
-        token *out = string_to_token(reader, string);
-        string_builder_clear(&reader->tok);
-        return out;
+    out->length = end - i;
+    return end;
+}
+
+// turns a raw token into a real one in the token stream, interning its
+// text, or reports it if it's an error
+token *cook_token(tokenizer *reader, raw_token *raw) {
+    char *string = reader->source->buffer + raw->offset;
+    token *output;
+    if(raw->type <= RAW_UNKNOWN) {
+        tokenizer_error_barrier();
     }
-    if(current_tokenizer->parent != NULL) {
-        tokenizer *up = current_tokenizer->parent;
-        tokenizer_delete(current_tokenizer);
-        current_tokenizer = up;
-        return tokenizer_get2(current_tokenizer);
-    } else {
-        reader->output = create_token(TOK_EOF);
-        return reader->output;
+    switch(raw->type) {
+        case RAW_UNKNOWN:
+            printf("Unknown token: \"%c\"\n", string[0]);
+            exit(1);
+        case RAW_SPLIT_STRING:
+            printf("error: String is split over newline.\n");
+            exit(1);
+        case RAW_SPLIT_CHAR:
+            printf("error: Char is split over newline.\n");
+            exit(1);
+        case RAW_UNTERMINATED:
+            printf("Reached EOF while parsing string or char.\n");
+            exit(1);
+        case TOK_IDENTIFIER:
+            output = create_token(TOK_IDENTIFIER);
+            output->string = intern_string_hashed(string, raw->length, raw->value);
+            break;
+        case TOK_STRING_CONST:
+            output = create_token(TOK_STRING_CONST);
+            output->string = intern_string_hashed(string + 1, raw->length - 2, raw->value);
+            break;
+        case TOK_CHAR_CONST:
+            output = create_token(TOK_CHAR_CONST);
+            output->value = (char)get_char_value(string + 1, raw->length - 2);
+            break;
+        default:
+            output = create_token(raw->type);
+            output->value = raw->value;
     }
+    return finish_token(reader, output, string, raw->length);
 }
 
-token *tokenizer_get_f(tokenizer *reader) {
-    return tokenizer_get2(reader);
+// called after lexing the token at offset while not replaying, if a thread
+// lexed a token starting at the same place then everything after it is the
+// same too and the replay picks up again
+void tokenizer_resync(tokenizer *reader, int offset) {
+    int i = reader->raw_index;
+    while(i < reader->raw_count && (reader->raw[i].type == RAW_RESYNC || reader->raw[i].offset < offset)) {
+        i++;
+    }
+    reader->raw_index = i;
+    if(i < reader->raw_count && reader->raw[i].offset == offset) {
+        reader->raw_index = i + 1;
+        reader->replaying = 1;
+    }
 }
 
-token *tokenizer_peek_f(tokenizer *reader) {
-    token *out = tokenizer_get2(reader);
-    reader->peeked = 1;
-    return out;
+void cache_add(source_file *source, token *tok) {
+    if((source->cache_count & (source->cache_count - 1)) == 0) {
+        source->cache = realloc(source->cache, (source->cache_count == 0 ? 1 : source->cache_count * 2) * sizeof(token *));
+    }
+    source->cache[source->cache_count++] = tok;
+}
+
+// a directive or skipped region, these only go as far as the preprocessor
+token *marker_token(tokenizer *reader, int type, int offset, int length) {
+    token *tok = create_token(type);
+    tok->file = reader->source->id;
+    tok->offset = offset;
+    tok->length = length;
+    return tok;
+}
+
+// the next token of the file, lexed, replayed from the threads' raw
+// tokens or taken from the file's cache, directives are returned too
+token *tokenizer_next_token(tokenizer *reader) {
+    source_file *source = reader->source;
+    int length = source->length;
+    if(reader->from_cache) {
+        while(reader->limit == 0) {
+            if(reader->cache_index == source->cache_count) {
+                return NULL;
+            }
+            token *tok = source->cache[reader->cache_index++];
+            if(tok->type != RAW_SKIPPED) {
+                return tok;
+            }
+            // skipped when the cache was recorded but active now
+            reader->offset = tok->offset;
+            reader->limit = tok->offset + tok->length;
+        }
+        length = reader->limit;
+    }
+    
+    raw_token raw;
+    if(reader->replaying) {
+        raw = reader->raw[reader->raw_index++];
+        if(raw.type == RAW_RESYNC) {
+            reader->replaying = 0;
+        } else {
+            reader->offset = raw.offset + raw.length;
+        }
+    }
+    if(!reader->replaying) {
+        reader->offset = lex_raw_token(source->buffer, reader->offset, length, &raw);
+        if(reader->raw != NULL) {
+            tokenizer_resync(reader, raw.offset);
+        }
+    }
+    
+    token *tok;
+    if(raw.type == TOK_EOF && reader->from_cache) {
+        reader->limit = 0;
+        return tokenizer_next_token(reader);
+    } else if(raw.type == TOK_EOF) {
+        // lexing again from the end keeps giving EOF
+        reader->replaying = 0;
+        if(reader->recording) {
+            reader->recording = 0;
+            source->cache_state = CACHE_DONE;
+        }
+        return NULL;
+    } else if(raw.type == RAW_DIRECTIVE) {
+        // kept in the stream like any other token so the cache can hold it
+        tok = marker_token(reader, RAW_DIRECTIVE, raw.offset, raw.length);
+    } else {
+        tok = cook_token(reader, &raw);
+    }
+    if(reader->recording) {
+        cache_add(source, tok);
+    }
+    return tok;
+}
+
+enum {
+    DIRECTIVE_OTHER,
+    DIRECTIVE_IF,
+    DIRECTIVE_ELIF,
+    DIRECTIVE_ELSE,
+    DIRECTIVE_ENDIF
+};
+
+int word_is(char *string, int length, char *word) {
+    return length == (int)strlen(word) && memcmp(string, word, length) == 0;
+}
+
+// start is just past the #, sets name_end to just past the directive's name
+int directive_kind(char *buffer, int start, int end, int *name_end) {
+    while(start < end && (buffer[start] == ' ' || buffer[start] == '\t')) {
+        start++;
+    }
+    *name_end = scan_identifier(buffer, start, end);
+    int length = *name_end - start;
+    if(word_is(buffer + start, length, "if") || word_is(buffer + start, length, "ifdef") || word_is(buffer + start, length, "ifndef")) {
+        return DIRECTIVE_IF;
+    } else if(word_is(buffer + start, length, "elif")) {
+        return DIRECTIVE_ELIF;
+    } else if(word_is(buffer + start, length, "else")) {
+        return DIRECTIVE_ELSE;
+    } else if(word_is(buffer + start, length, "endif")) {
+        return DIRECTIVE_ENDIF;
+    }
+    return DIRECTIVE_OTHER;
+}
+
+// the offset of the next # at the start of a line, or length if there's
+// none
+int find_directive(char *buffer, int i, int length) {
+    while(i < length) {
+        char *hash = memchr(buffer + i, '#', length - i);
+        if(hash == NULL) {
+            break;
+        }
+        if(is_line_start(buffer, hash - buffer)) {
+            return hash - buffer;
+        }
+        i = hash - buffer + 1;
+    }
+    return length;
+}
+
+// starts reading the files source includes before the tokenizer gets to
+// them, #if isn't looked at so some of them may never be used
+void prefetch_includes(source_file *source, char *filename) {
+    char *buffer = source->buffer;
+    int i = 0;
+    while((i = find_directive(buffer, i, source->length)) < source->length) {
+        int end = line_end(buffer, i, source->length);
+        int start = scan_blank(buffer, i + 1, end);
+        int name_end = scan_identifier(buffer, start, end);
+        if(word_is(buffer + start, name_end - start, "include")) {
+            start = scan_blank(buffer, name_end, end);
+            char close = start < end && buffer[start] == '"' ? '"' : '>';
+            char *found = start < end && (buffer[start] == '"' || buffer[start] == '<') ? memchr(buffer + start + 1, close, end - start - 1) : NULL;
+            if(found != NULL) {
+                char *name = malloc(found - (buffer + start));
+                memcpy(name, buffer + start + 1, found - (buffer + start) - 1);
+                name[found - (buffer + start) - 1] = '\0';
+                char *path = include_resolve(name, filename, close == '"');
+                if(path != NULL && source_file_find(path) == NULL) {
+                    include_prefetch(path);
+                }
+                free(name);
+            }
+        }
+        i = end;
+    }
+}
+
+// reads past the #elif or #else that starts the next active branch of the
+// innermost block, or with to_endif set (or none active) past its #endif.
+// Only directives are looked at, the text between them is never lexed.
+void skip_inactive(tokenizer *reader, int to_endif) {
+    source_file *source = reader->source;
+    char *buffer = source->buffer;
+    int depth = 0;
+    reader->replaying = 0;
+    reader->limit = 0;
+    while(1) {
+        int start;
+        int end;
+        if(reader->from_cache) {
+            while(reader->cache_index < source->cache_count && source->cache[reader->cache_index]->type != RAW_DIRECTIVE) {
+                reader->cache_index++;
+            }
+            if(reader->cache_index == source->cache_count) {
+                return;
+            }
+            token *tok = source->cache[reader->cache_index++];
+            start = tok->offset;
+            end = tok->offset + tok->length;
+        } else {
+            start = find_directive(buffer, reader->offset, source->length);
+            // the cache keeps what was skipped, in case it's active the
+            // next time the file is included
+            if(reader->recording && start > reader->offset) {
+                cache_add(source, marker_token(reader, RAW_SKIPPED, reader->offset, start - reader->offset));
+            }
+            if(start == source->length) {
+                reader->offset = start;
+                return;
+            }
+            end = line_end(buffer, start, source->length);
+            if(reader->recording) {
+                cache_add(source, marker_token(reader, RAW_DIRECTIVE, start, end - start));
+            }
+            reader->offset = end;
+        }
+        
+        int name_end;
+        int kind = directive_kind(buffer, start + 1, end, &name_end);
+        if(kind == DIRECTIVE_IF) {
+            depth++;
+        } else if(kind == DIRECTIVE_ENDIF && depth > 0) {
+            depth--;
+        } else if(kind == DIRECTIVE_ENDIF) {
+            conditional_pop(reader);
+            return;
+        } else if(kind == DIRECTIVE_ELSE && depth == 0) {
+            conditional_branch(reader, 1);
+            if(!to_endif) {
+                return;
+            }
+        } else if(kind == DIRECTIVE_ELIF && depth == 0) {
+            conditional_branch(reader, 0);
+            if(!to_endif && evaluate_condition(reader, name_end, end)) {
+                return;
+            }
+        }
+    }
+}
+
+// an #if expression with its macros expanded
+typedef struct condition {
+    token *tokens;
+    int count;
+    int index;
+} condition;
+
+void condition_error(char *message) {
+    tokenizer_error_barrier();
+    printf("Error in #if: %s\n", message);
+    exit(1);
+}
+
+void condition_add(condition *c, token *tok) {
+    if((c->count & (c->count - 1)) == 0) {
+        c->tokens = realloc(c->tokens, (c->count == 0 ? 1 : c->count * 2) * sizeof(token));
+    }
+    c->tokens[c->count++] = *tok;
+}
+
+void condition_add_number(condition *c, int value) {
+    token number;
+    number.type = TOK_INT_CONST;
+    number.value = value;
+    number.string = NULL;
+    condition_add(c, &number);
+}
+
+// identifiers that aren't macros are 0, and defined X is whether X is a
+// macro
+void condition_expand(condition *c, token **tokens, int count) {
+    int i;
+    for(i = 0; i < count; i++) {
+        token *tok = tokens[i];
+        if(tok->type == TOK_IDENTIFIER && tok->string == defined_string) {
+            int parens = i + 1 < count && tokens[i + 1]->type == TOK_LPAREN;
+            int name = i + 1 + parens;
+            if(name >= count || tokens[name]->type != TOK_IDENTIFIER || (parens && (name + 1 >= count || tokens[name + 1]->type != TOK_RPAREN))) {
+                condition_error("defined needs a macro name.");
+            }
+            condition_add_number(c, macro_find(tokens[name]->string) != NULL);
+            i = name + parens;
+        } else if(tok->type == TOK_IDENTIFIER) {
+            macro *m = macro_find(tok->string);
+            if(m == NULL || m->expanding) {
+                condition_add_number(c, 0);
+            } else if(m->function_like) {
+                condition_error("function-like macros can't be used in #if.");
+            } else {
+                m->expanding = 1;
+                condition_expand(c, m->body, m->body_length);
+                m->expanding = 0;
+            }
+        } else {
+            condition_add(c, tok);
+        }
+    }
+}
+
+// lower binds tighter, as in the parser, 0 if it isn't a binary operator
+int condition_precedence(int type) {
+    switch(type) {
+        case TOK_STAR:
+        case TOK_DIVIDE:
+        case TOK_MOD:
+            return 3;
+        case TOK_PLUS:
+        case TOK_MINUS:
+            return 4;
+        case TOK_LSH:
+        case TOK_RSH:
+            return 5;
+        case TOK_LESS:
+        case TOK_MORE:
+        case TOK_LESS_EQUAL:
+        case TOK_MORE_EQUAL:
+            return 6;
+        case TOK_EQUAL_TO:
+        case TOK_NOT_EQUAL:
+            return 7;
+        case TOK_AMPERSAND:
+            return 8;
+        case TOK_XOR:
+            return 9;
+        case TOK_BITWISE_OR:
+            return 10;
+        case TOK_AND:
+            return 11;
+        case TOK_OR:
+            return 12;
+        default:
+            return 0;
+    }
+}
+
+long long condition_apply(int type, long long left, long long right) {
+    if((type == TOK_DIVIDE || type == TOK_MOD) && right == 0) {
+        condition_error("division by zero.");
+    }
+    switch(type) {
+        case TOK_STAR:
+            return left * right;
+        case TOK_DIVIDE:
+            return left / right;
+        case TOK_MOD:
+            return left % right;
+        case TOK_PLUS:
+            return left + right;
+        case TOK_MINUS:
+            return left - right;
+        case TOK_LSH:
+            return left << right;
+        case TOK_RSH:
+            return left >> right;
+        case TOK_LESS:
+            return left < right;
+        case TOK_MORE:
+            return left > right;
+        case TOK_LESS_EQUAL:
+            return left <= right;
+        case TOK_MORE_EQUAL:
+            return left >= right;
+        case TOK_EQUAL_TO:
+            return left == right;
+        case TOK_NOT_EQUAL:
+            return left != right;
+        case TOK_AMPERSAND:
+            return left & right;
+        case TOK_XOR:
+            return left ^ right;
+        case TOK_BITWISE_OR:
+            return left | right;
+        case TOK_AND:
+            return left && right;
+        default:
+            return left || right;
+    }
+}
+
+token *condition_next(condition *c) {
+    if(c->index == c->count) {
+        condition_error("expected more after the end of the expression.");
+    }
+    return &c->tokens[c->index++];
+}
+
+long long condition_expression(condition *c);
+
+long long condition_unary(condition *c) {
+    token *tok = condition_next(c);
+    long long value;
+    switch(tok->type) {
+        case TOK_INT_CONST:
+        case TOK_CHAR_CONST:
+            return tok->value;
+        case TOK_LPAREN:
+            value = condition_expression(c);
+            if(condition_next(c)->type != TOK_RPAREN) {
+                condition_error("expected ).");
+            }
+            return value;
+        case TOK_NOT:
+            return !condition_unary(c);
+        case TOK_BITWISE_NOT:
+            return ~condition_unary(c);
+        case TOK_MINUS:
+            return -condition_unary(c);
+        case TOK_PLUS:
+            return condition_unary(c);
+        default:
+            condition_error("expected a number.");
+            return 0;
+    }
+}
+
+// operators looser than level are left for the caller
+long long condition_binary(condition *c, int level) {
+    long long left = condition_unary(c);
+    while(c->index < c->count) {
+        int type = c->tokens[c->index].type;
+        int precedence = condition_precedence(type);
+        if(precedence == 0 || precedence > level) {
+            break;
+        }
+        c->index++;
+        left = condition_apply(type, left, condition_binary(c, precedence - 1));
+    }
+    return left;
+}
+
+long long condition_expression(condition *c) {
+    long long value = condition_binary(c, 12);
+    if(c->index < c->count && c->tokens[c->index].type == TOK_QUESTION_MARK) {
+        c->index++;
+        long long if_true = condition_expression(c);
+        if(condition_next(c)->type != TOK_COLON) {
+            condition_error("expected : after ?.");
+        }
+        long long if_false = condition_expression(c);
+        return value ? if_true : if_false;
+    }
+    return value;
+}
+
+// whether the expression from start to end is true
+int evaluate_condition(tokenizer *reader, int start, int end) {
+    char *buffer = reader->source->buffer;
+    token *line = NULL;
+    token **pointers;
+    int count = 0;
+    int i;
+    raw_token raw;
+    while((start = lex_raw_token(buffer, start, end, &raw)), raw.type != TOK_EOF) {
+        if(raw.type < 0 || raw.type == TOK_STRING_CONST) {
+            condition_error("expected a number.");
+        }
+        if((count & (count - 1)) == 0) {
+            line = realloc(line, (count == 0 ? 1 : count * 2) * sizeof(token));
+        }
+        token *tok = &line[count++];
+        tok->type = raw.type;
+        tok->value = raw.value;
+        tok->string = NULL;
+        if(raw.type == TOK_IDENTIFIER) {
+            tok->string = intern_string_hashed(buffer + raw.offset, raw.length, raw.value);
+        } else if(raw.type == TOK_CHAR_CONST) {
+            tok->value = (char)get_char_value(buffer + raw.offset + 1, raw.length - 2);
+        }
+    }
+    pointers = malloc((count + 1) * sizeof(token *));
+    for(i = 0; i < count; i++) {
+        pointers[i] = &line[i];
+    }
+    
+    condition c;
+    c.tokens = NULL;
+    c.count = 0;
+    c.index = 0;
+    condition_expand(&c, pointers, count);
+    long long value = condition_expression(&c);
+    if(c.index != c.count) {
+        condition_error("unexpected token after the expression.");
+    }
+    free(c.tokens);
+    free(pointers);
+    free(line);
+    return value != 0;
+}
+
+token *tokenizer_get2(tokenizer *reader) {
+    token *tok;
+    while((tok = tokenizer_next_token(reader)) != NULL && tok->type == RAW_DIRECTIVE) {
+        parse_macro(reader, reader->source->buffer + tok->offset + 1, tok->length - 1);
+        if(current_tokenizer != reader) {
+            return tokenizer_get2(current_tokenizer);
+        }
+    }
+    
+    if(tok == NULL) {
+        guard_end(reader);
+        if(reader->parent != NULL) {
+            tokenizer *up = reader->parent;
+            tokenizer_delete(reader);
+            current_tokenizer = up;
+            return tokenizer_get2(current_tokenizer);
+        }
+        if(reader->output == NULL || reader->output->type != TOK_EOF) {
+            finish_token(reader, create_token(TOK_EOF), reader->source->buffer + reader->source->length, 0);
+        }
+        return reader->output;
+    }
+    guard_token(reader);
+    reader->output = tok;
+    return tok;
+}
+
+macro *macro_lookup(char *name) {
+    int i = interned_hash(name) & (macro_table_size - 1);
+    while(macro_table[i] != NULL && macro_table[i]->name != name) {
+        i = (i + 1) & (macro_table_size - 1);
+    }
+    return macro_table[i];
+}
+
+macro *macro_find(char *name) {
+    if(macro_table_used == 0) {
+        return NULL;
+    }
+    macro *m = macro_lookup(name);
+    return m != NULL && m->defined ? m : NULL;
+}
+
+void macro_table_grow() {
+    macro **old = macro_table;
+    int old_size = macro_table_size;
+    int i;
+    macro_table_size <<= 1;
+    macro_table = calloc(macro_table_size, sizeof(macro *));
+    for(i = 0; i < old_size; i++) {
+        if(old[i] != NULL) {
+            int j = interned_hash(old[i]->name) & (macro_table_size - 1);
+            while(macro_table[j] != NULL) {
+                j = (j + 1) & (macro_table_size - 1);
+            }
+            macro_table[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+// an empty definition for name to be filled in, replacing any earlier one
+macro *macro_define(char *name) {
+    macro *m = macro_lookup(name);
+    if(m == NULL) {
+        int i = interned_hash(name) & (macro_table_size - 1);
+        while(macro_table[i] != NULL) {
+            i = (i + 1) & (macro_table_size - 1);
+        }
+        m = region_alloc(&tokenizer_region, sizeof(macro));
+        m->name = name;
+        m->parameters = NULL;
+        m->body = NULL;
+        m->expanding = 0;
+        macro_table[i] = m;
+        macro_table_used++;
+        if(macro_table_used * 2 > macro_table_size) {
+            macro_table_grow();
+        }
+    }
+    free(m->parameters);
+    free(m->body);
+    m->defined = 1;
+    m->function_like = 0;
+    m->parameters = NULL;
+    m->parameter_count = 0;
+    m->body = NULL;
+    m->body_length = 0;
+    return m;
+}
+
+void define_error(char *message) {
+    tokenizer_error_barrier();
+    printf("Error in #define: %s\n", message);
+    exit(1);
+}
+
+// the directive runs from start to end, just after the #, returns the
+// name of the macro
+char *parse_define(tokenizer *reader, int start, int end) {
+    char *buffer = reader->source->buffer;
+    raw_token raw;
+    // skip the word define
+    int i = lex_raw_token(buffer, start, end, &raw);
+    i = lex_raw_token(buffer, i, end, &raw);
+    if(raw.type != TOK_IDENTIFIER) {
+        define_error("the macro name has to be an identifier.");
+    }
+    macro *m = macro_define(intern_string_hashed(buffer + raw.offset, raw.length, raw.value));
+    
+    // only a ( straight after the name makes it function-like
+    if(i < end && buffer[i] == '(') {
+        m->function_like = 1;
+        i = lex_raw_token(buffer, i + 1, end, &raw);
+        while(raw.type != TOK_RPAREN) {
+            if(raw.type != TOK_IDENTIFIER) {
+                define_error("expected a parameter name.");
+            }
+            if((m->parameter_count & (m->parameter_count - 1)) == 0) {
+                m->parameters = realloc(m->parameters, (m->parameter_count == 0 ? 1 : m->parameter_count * 2) * sizeof(char *));
+            }
+            m->parameters[m->parameter_count++] = intern_string_hashed(buffer + raw.offset, raw.length, raw.value);
+            i = lex_raw_token(buffer, i, end, &raw);
+            if(raw.type == TOK_COMMA) {
+                i = lex_raw_token(buffer, i, end, &raw);
+            } else if(raw.type != TOK_RPAREN) {
+                define_error("expected , or ) after a parameter.");
+            }
+        }
+    }
+    
+    while((i = lex_raw_token(buffer, i, end, &raw)), raw.type != TOK_EOF) {
+        if((m->body_length & (m->body_length - 1)) == 0) {
+            m->body = realloc(m->body, (m->body_length == 0 ? 1 : m->body_length * 2) * sizeof(token *));
+        }
+        m->body[m->body_length++] = cook_token(reader, &raw);
+    }
+    return m->name;
+}
+
+void expansion_push(macro *source, token **tokens, int count, int owned) {
+    if(expansion_count == expansion_capacity) {
+        expansion_capacity = expansion_capacity == 0 ? 16 : expansion_capacity * 2;
+        expansions = realloc(expansions, expansion_capacity * sizeof(expansion));
+    }
+    expansion *e = &expansions[expansion_count++];
+    e->source = source;
+    e->tokens = tokens;
+    e->count = count;
+    e->index = 0;
+    e->owned = owned;
+    if(source != NULL) {
+        source->expanding = 1;
+    }
+}
+
+// the next token from the innermost expansion, or the file once they're
+// all used up. An expansion with no macro is a macro's argument being
+// expanded on its own, and gives NULL at its end instead of carrying on.
+token *expansion_next() {
+    if(pushed_back != NULL) {
+        token *tok = pushed_back;
+        pushed_back = NULL;
+        return tok;
+    }
+    while(expansion_count > 0) {
+        expansion *top = &expansions[expansion_count - 1];
+        if(top->index < top->count) {
+            return top->tokens[top->index++];
+        }
+        if(top->source == NULL) {
+            return NULL;
+        }
+        top->source->expanding = 0;
+        if(top->owned) {
+            free(top->tokens);
+        }
+        expansion_count--;
+    }
+    return tokenizer_get2(current_tokenizer);
+}
+
+token *preprocess_get();
+
+// expands an argument before it's substituted, as C does
+void expand_argument(token **tokens, int count, toklist *out) {
+    token *tok;
+    expansion_push(NULL, tokens, count, 0);
+    while((tok = preprocess_get()) != NULL) {
+        toklist_add(out, tok);
+    }
+    expansion_count--;
+}
+
+void macro_call_error(macro *m, char *message) {
+    tokenizer_error_barrier();
+    printf("Error: macro %s %s\n", m->name, message);
+    exit(1);
+}
+
+// reads the arguments up to the closing ) and starts the expansion
+void macro_call(macro *m) {
+    toklist arguments;
+    toklist_init(&arguments, NULL);
+    int *starts = malloc((m->parameter_count + 2) * sizeof(int));
+    int count = 0;
+    int depth = 0;
+    starts[0] = 0;
+    while(1) {
+        token *tok = expansion_next();
+        if(tok == NULL || tok->type == TOK_EOF) {
+            macro_call_error(m, "is missing the ) after its arguments.");
+        }
+        if(tok->type == TOK_LPAREN) {
+            depth++;
+        } else if(tok->type == TOK_RPAREN) {
+            if(depth == 0) {
+                break;
+            }
+            depth--;
+        } else if(tok->type == TOK_COMMA && depth == 0) {
+            count++;
+            if(count >= m->parameter_count) {
+                macro_call_error(m, "is given too many arguments.");
+            }
+            starts[count] = arguments.length;
+            continue;
+        }
+        toklist_add(&arguments, tok);
+    }
+    count++;
+    starts[count] = arguments.length;
+    // f() has no arguments rather than one empty one
+    if(m->parameter_count == 0 && arguments.length == 0) {
+        count = 0;
+    }
+    if(count > m->parameter_count) {
+        macro_call_error(m, "is given too many arguments.");
+    } else if(count < m->parameter_count) {
+        macro_call_error(m, "is given too few arguments.");
+    }
+    
+    toklist expanded;
+    toklist_init(&expanded, NULL);
+    int *expanded_starts = malloc((count + 1) * sizeof(int));
+    int i;
+    for(i = 0; i < count; i++) {
+        expanded_starts[i] = expanded.length;
+        expand_argument(arguments.items + starts[i], starts[i + 1] - starts[i], &expanded);
+    }
+    expanded_starts[count] = expanded.length;
+    
+    toklist body;
+    toklist_init(&body, NULL);
+    for(i = 0; i < m->body_length; i++) {
+        token *tok = m->body[i];
+        int parameter = -1;
+        if(tok->type == TOK_IDENTIFIER) {
+            int j;
+            for(j = 0; j < count; j++) {
+                if(m->parameters[j] == tok->string) {
+                    parameter = j;
+                    break;
+                }
+            }
+        }
+        if(parameter == -1) {
+            toklist_add(&body, tok);
+        } else {
+            int j;
+            for(j = expanded_starts[parameter]; j < expanded_starts[parameter + 1]; j++) {
+                toklist_add(&body, expanded.items[j]);
+            }
+        }
+    }
+    // the tokens themselves are handed over to the expansion
+    int length = body.length;
+    expansion_push(m, toklist_detach(&body), length, 1);
+    toklist_end(&expanded);
+    toklist_end(&arguments);
+    free(expanded_starts);
+    free(starts);
+}
+
+// the next token with macros expanded, NULL at the end of an argument
+// being expanded on its own
+token *preprocess_get() {
+    while(1) {
+        token *tok = expansion_next();
+        if(tok == NULL || tok->type != TOK_IDENTIFIER) {
+            return tok;
+        }
+        macro *m = macro_find(tok->string);
+        if(m == NULL || m->expanding) {
+            return tok;
+        }
+        if(!m->function_like) {
+            expansion_push(m, m->body, m->body_length, 0);
+            continue;
+        }
+        token *next = expansion_next();
+        if(next == NULL || next->type != TOK_LPAREN) {
+            // just the name, not a call
+            pushed_back = next;
+            return tok;
+        }
+        macro_call(m);
+    }
+}
+
+// one piece of a file being lexed by tokenizer_lex_parallel()
+typedef struct lex_chunk {
+    char *buffer;
+    int length;
+    // the tokens starting in [start, end)
+    int start;
+    int end;
+    raw_token *tokens;
+    int count;
+    // where the first token was found, and where the first token past the
+    // end was found, or -1 after an error
+    int first;
+    int stop;
+    #if TOKENIZER_USE_THREADS
+        pthread_t thread;
+    #endif
+} lex_chunk;
+
+void *lex_chunk_run(void *arg) {
+    lex_chunk *chunk = arg;
+    int capacity = 1024;
+    int i = chunk->start;
+    chunk->tokens = malloc(capacity * sizeof(raw_token));
+    chunk->count = 0;
+    chunk->first = -1;
+    chunk->stop = -1;
+    while(1) {
+        raw_token raw;
+        int next = lex_raw_token(chunk->buffer, i, chunk->length, &raw);
+        if(chunk->first == -1) {
+            chunk->first = raw.offset;
+        }
+        // the last chunk keeps its EOF token
+        if(raw.offset >= chunk->end && chunk->end < chunk->length) {
+            chunk->stop = raw.offset;
+            break;
+        }
+        if(chunk->count == capacity) {
+            capacity *= 2;
+            chunk->tokens = realloc(chunk->tokens, capacity * sizeof(raw_token));
+        }
+        chunk->tokens[chunk->count++] = raw;
+        if(raw.type == TOK_EOF || raw.type <= RAW_UNKNOWN) {
+            break;
+        }
+        i = next;
+    }
+    return NULL;
+}
+
+// splits the file at line starts into one chunk per thread and lexes them
+// all at once, then joins the tokens up for tokenizer_get2() to replay.
+// Each chunk is lexed as though it starts outside of any comment, so where
+// a chunk doesn't pick up exactly where the one before it stopped, a block
+// comment ran over the boundary, and the replay falls back to lexing
+// serially until it lands on a token a thread also found.
+void tokenizer_lex_parallel(tokenizer *reader, int threads) {
+    char *buffer = reader->source->buffer;
+    int length = reader->source->length;
+    int count = length / tokenizer_min_chunk;
+    if(count > threads) {
+        count = threads;
+    }
+    if(count < 2) {
+        return;
+    }
+    
+    lex_chunk *chunks = malloc(count * sizeof(lex_chunk));
+    int start = 0;
+    int i;
+    for(i = 0; i < count; i++) {
+        int end = length;
+        if(i < count - 1) {
+            end = (int)((long long)length * (i + 1) / count);
+            char *newline = memchr(buffer + end, '\n', length - end);
+            end = newline == NULL ? length : newline - buffer + 1;
+            if(end < start) {
+                end = start;
+            }
+        }
+        chunks[i].buffer = buffer;
+        chunks[i].length = length;
+        chunks[i].start = start;
+        chunks[i].end = end;
+        start = end;
+    }
+    
+    #if TOKENIZER_USE_THREADS
+        for(i = 0; i < count; i++) {
+            if(pthread_create(&chunks[i].thread, NULL, lex_chunk_run, &chunks[i]) != 0) {
+                printf("Error: cannot start lexer thread.\n");
+                exit(1);
+            }
+        }
+        for(i = 0; i < count; i++) {
+            pthread_join(chunks[i].thread, NULL);
+        }
+    #else
+        for(i = 0; i < count; i++) {
+            lex_chunk_run(&chunks[i]);
+        }
+    #endif
+    
+    int total = count - 1;
+    for(i = 0; i < count; i++) {
+        total += chunks[i].count;
+    }
+    reader->raw = malloc(total * sizeof(raw_token));
+    reader->raw_count = 0;
+    for(i = 0; i < count; i++) {
+        if(i > 0 && chunks[i].first != chunks[i - 1].stop) {
+            raw_token *resync = &reader->raw[reader->raw_count++];
+            resync->type = RAW_RESYNC;
+            resync->value = 0;
+            resync->offset = chunks[i].start;
+            resync->length = 0;
+        }
+        memcpy(reader->raw + reader->raw_count, chunks[i].tokens, chunks[i].count * sizeof(raw_token));
+        reader->raw_count += chunks[i].count;
+        free(chunks[i].tokens);
+    }
+    free(chunks);
+    reader->raw_index = 0;
+    reader->replaying = 1;
+}
+
+#if TOKENIZER_USE_THREADS
+// waits while the ring is full, publishing what's there so the parser can
+// make room
+void pipeline_push(token *tok) {
+    while(pipeline_write - atomic_load_explicit(&pipeline_tail, memory_order_acquire) == TOKENIZER_PIPELINE_SIZE) {
+        atomic_store_explicit(&pipeline_head, pipeline_write, memory_order_release);
+        sched_yield();
+    }
+    pipeline[pipeline_write & (TOKENIZER_PIPELINE_SIZE - 1)] = tok;
+    pipeline_write++;
+    if((pipeline_write & (TOKENIZER_PIPELINE_BATCH - 1)) == 0) {
+        atomic_store_explicit(&pipeline_head, pipeline_write, memory_order_release);
+    }
+}
+
+// lexes the whole input, including switching into included files
+void *pipeline_run(void *arg) {
+    (void)arg;
+    on_lexer_thread = 1;
+    while(1) {
+        token *tok = preprocess_get();
+        pipeline_push(tok);
+        if(tok->type == TOK_EOF) {
+            atomic_store_explicit(&pipeline_head, pipeline_write, memory_order_release);
+            return NULL;
+        }
+    }
+}
+
+token *pipeline_pop() {
+    unsigned int tail = atomic_load_explicit(&pipeline_tail, memory_order_relaxed);
+    while(atomic_load_explicit(&pipeline_head, memory_order_acquire) == tail) {
+        sched_yield();
+    }
+    token *tok = pipeline[tail & (TOKENIZER_PIPELINE_SIZE - 1)];
+    atomic_store_explicit(&pipeline_tail, tail + 1, memory_order_release);
+    if(tok == NULL) {
+        // the lexer thread reports its error and exits
+        atomic_store(&pipeline_error, 1);
+        pthread_join(pipeline_thread, NULL);
+    }
+    if(tok->type == TOK_EOF) {
+        pthread_join(pipeline_thread, NULL);
+        pipeline_running = 0;
+    }
+    return tok;
+}
+#endif
+
+// the next token, from the lexer thread if it's running
+token *tokenizer_next() {
+    if(replay_tokens != NULL) {
+        return replay_index < replay_count ? replay_tokens[replay_index++] : &replay_end;
+    }
+    #if TOKENIZER_USE_THREADS
+        if(tokenizer_pipeline && !pipeline_started) {
+            pipeline_started = 1;
+            pipeline_running = 1;
+            if(pthread_create(&pipeline_thread, NULL, pipeline_run, NULL) != 0) {
+                printf("Error: cannot start lexer thread.\n");
+                exit(1);
+            }
+        }
+        if(pipeline_running) {
+            return pipeline_pop();
+        }
+    #endif
+    return preprocess_get();
+}
+
+// lexes until the lookahead buffer is full or the end of the input is
+// reached, so the lexer runs in batches rather than once per peek
+void tokenizer_fill() {
+    if(lookahead_count != 0 && lookahead[(lookahead_start + lookahead_count - 1) & (TOKENIZER_LOOKAHEAD - 1)]->type == TOK_EOF) {
+        return;
+    }
+    while(lookahead_count < TOKENIZER_LOOKAHEAD) {
+        token *tok = tokenizer_next();
+        lookahead[(lookahead_start + lookahead_count) & (TOKENIZER_LOOKAHEAD - 1)] = tok;
+        lookahead_count++;
+        if(tok->type == TOK_EOF) {
+            return;
+        }
+    }
+}
+
+// n = 0 is the next token, past the end of the input this keeps returning
+// the EOF token
+token *tokenizer_peek_n(int n) {
+    if(n >= TOKENIZER_LOOKAHEAD) {
+        printf("Error: cannot look ahead %d tokens.\n", n + 1);
+        exit(1);
+    }
+    if(n >= lookahead_count) {
+        tokenizer_fill();
+        if(n >= lookahead_count) {
+            n = lookahead_count - 1;
+        }
+    }
+    return lookahead[(lookahead_start + n) & (TOKENIZER_LOOKAHEAD - 1)];
+}
+
+token *tokenizer_peek() {
+    return tokenizer_peek_n(0);
 }
 
 token *tokenizer_get() {
-    return tokenizer_get_f(current_tokenizer);
+    token *out = tokenizer_peek_n(0);
+    if(out->type != TOK_EOF) {
+        lookahead_start = (lookahead_start + 1) & (TOKENIZER_LOOKAHEAD - 1);
+        lookahead_count--;
+    }
+    last_token = out;
+    return out;
 }
 
-token *tokenizer_peek(tokenizer *reader) {
-    return tokenizer_peek_f(current_tokenizer);
+// the last token taken with tokenizer_get()
+token *tokenizer_last() {
+    return last_token;
 }
 
+void tokenizer_replay(token **tokens, int count) {
+    memcpy(saved_lookahead, lookahead, sizeof(lookahead));
+    saved_lookahead_start = lookahead_start;
+    saved_lookahead_count = lookahead_count;
+    saved_last_token = last_token;
+    lookahead_start = 0;
+    lookahead_count = 0;
+    replay_tokens = tokens;
+    replay_count = count;
+    replay_index = 0;
+    replay_end = *tokens[count - 1];
+    replay_end.type = TOK_EOF;
+}
+
+void tokenizer_replay_end() {
+    memcpy(lookahead, saved_lookahead, sizeof(lookahead));
+    lookahead_start = saved_lookahead_start;
+    lookahead_count = saved_lookahead_count;
+    last_token = saved_last_token;
+    replay_tokens = NULL;
+}
+
+// tokens are never freed on their own, the whole stream goes at once
 token *create_token(int type) {
-    token *out = malloc(sizeof(token));
+    if(tokens.length == tokens.block_count * TOKEN_BLOCK_SIZE) {
+        tokens.blocks = realloc(tokens.blocks, (tokens.block_count + 1) * sizeof(token *));
+        tokens.blocks[tokens.block_count] = malloc(TOKEN_BLOCK_SIZE * sizeof(token));
+        tokens.block_count++;
+    }
+    token *out = token_stream_get(&tokens, tokens.length);
+    tokens.length++;
     out->type = type;
-    out->line_offset = -1;
+    out->value = 0;
+    out->string = NULL;
+    out->file = -1;
+    out->offset = 0;
+    out->length = 0;
     return out;
 }
 
-void delete_token(token *t) {
-    printf("FREEING TOKEN\n");
-    if(t->string != NULL) {
-        free(t->string);
+token *token_stream_get(token_stream *stream, int index) {
+    return &stream->blocks[index >> TOKEN_BLOCK_BITS][index & (TOKEN_BLOCK_SIZE - 1)];
+}
+
+char *token_start(token *tok) {
+    if(tok->file == -1) {
+        return NULL;
     }
-    free(t);
+    return source_file_get(tok->file)->buffer + tok->offset;
+}
+
+char *token_filename(token *tok) {
+    if(tok->file == -1) {
+        return current_tokenizer->filename;
+    }
+    return source_file_get(tok->file)->filename;
+}
+
+void source_file_index_lines(source_file *source) {
+    int buffer_length = 64;
+    char *p = source->buffer;
+    char *end = source->buffer + source->length;
+    source->line_starts = malloc(buffer_length * sizeof(int));
+    source->line_starts[0] = 0;
+    source->line_count = 1;
+    while((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        if(source->line_count == buffer_length) {
+            buffer_length <<= 1;
+            source->line_starts = realloc(source->line_starts, buffer_length * sizeof(int));
+        }
+        source->line_starts[source->line_count] = p - source->buffer;
+        source->line_count++;
+    }
+}
+
+// the index of the line containing offset, found by binary search
+int source_file_line(source_file *source, int offset) {
+    if(source->line_starts == NULL) {
+        source_file_index_lines(source);
+    }
+    int low = 0;
+    int high = source->line_count - 1;
+    while(low < high) {
+        int middle = (low + high + 1) / 2;
+        if(source->line_starts[middle] <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+// lines start at 1 and columns at 0, both are -1 if tok has no position
+void token_position(token *tok, int *line, int *column) {
+    if(tok->file == -1) {
+        *line = -1;
+        *column = -1;
+        return;
+    }
+    source_file *source = source_file_get(tok->file);
+    int index = source_file_line(source, tok->offset);
+    *line = index + 1;
+    *column = tok->offset - source->line_starts[index];
+}
+
+// prints the line tok is on with tok highlighted and a caret under it
+void print_token_source(token *tok, char *color) {
+    if(tok->file == -1) {
+        return;
+    }
+    source_file *source = source_file_get(tok->file);
+    int index = source_file_line(source, tok->offset);
+    char *line = source->buffer + source->line_starts[index];
+    int line_length;
+    if(index + 1 < source->line_count) {
+        line_length = source->line_starts[index + 1] - source->line_starts[index];
+    } else {
+        line_length = source->length - source->line_starts[index];
+    }
+    int pos = tok->offset - source->line_starts[index];
+    int len = tok->length;
+    printf("%.*s", pos, line);
+    printf("\x1b[%sm%.*s\x1b[0m", color, len, line + pos);
+    printf("%.*s\n", line_length - (pos + len), line + pos + len);
+    printf("\x1b[%sm%*s^\x1b[0m\n", color, pos, "");
 }
 
 void free_tokens() {
     int i;
-    for(i = 0; i < tokens_to_free->length; i++) {
-        delete_token(toklist_get(tokens_to_free, i));
+    for(i = 0; i < tokens.block_count; i++) {
+        free(tokens.blocks[i]);
     }
+    free(tokens.blocks);
+    tokens.blocks = NULL;
+    tokens.block_count = 0;
+    tokens.length = 0;
 }
 
-int get_toktype_from_string(char *string) {
-    int i;
-    for(i = 0; i < sizeof(convert_table) / sizeof(convert_table[0]); i++) {
-        if(convert_table[i].string != NULL && strcmp(string, convert_table[i].string) == 0) {
-            return convert_table[i].value;
-        }
+// keywords are looked up with a switch on the first character followed by
+// a length check, so most identifiers are rejected without a single compare
+#define KEYWORD(name, value) if(length == sizeof(name) - 1 && memcmp(string, name, sizeof(name) - 1) == 0) return value
+
+int get_keyword_type(char *string, int length) {
+    if(length < 2 || length > 8) {
+        return -1;
+    }
+    switch(string[0]) {
+        case 'a':
+            KEYWORD("auto", TOK_AUTO);
+            KEYWORD("asm", TOK_ASM);
+            break;
+        case 'b':
+            KEYWORD("break", TOK_BREAK);
+            break;
+        case 'c':
+            KEYWORD("case", TOK_CASE);
+            KEYWORD("char", TOK_CHAR);
+            KEYWORD("const", TOK_CONST);
+            KEYWORD("continue", TOK_CONTINUE);
+            break;
+        case 'd':
+            KEYWORD("default", TOK_DEFAULT);
+            KEYWORD("do", TOK_DO);
+            KEYWORD("double", TOK_DOUBLE);
+            break;
+        case 'e':
+            KEYWORD("else", TOK_ELSE);
+            KEYWORD("enum", TOK_ENUM);
+            KEYWORD("extern", TOK_EXTERN);
+            break;
+        case 'f':
+            KEYWORD("float", TOK_FLOAT);
+            KEYWORD("for", TOK_FOR);
+            break;
+        case 'g':
+            KEYWORD("goto", TOK_GOTO);
+            break;
+        case 'i':
+            KEYWORD("if", TOK_IF);
+            KEYWORD("int", TOK_INT);
+            break;
+        case 'l':
+            KEYWORD("long", TOK_LONG);
+            break;
+        case 'r':
+            KEYWORD("register", TOK_REGISTER);
+            KEYWORD("return", TOK_RETURN);
+            break;
+        case 's':
+            KEYWORD("short", TOK_SHORT);
+            KEYWORD("signed", TOK_SIGNED);
+            KEYWORD("sizeof", TOK_SIZEOF);
+            KEYWORD("static", TOK_STATIC);
+            KEYWORD("struct", TOK_STRUCT);
+            KEYWORD("switch", TOK_SWITCH);
+            break;
+        case 't':
+            KEYWORD("typedef", TOK_TYPEDEF);
+            break;
+        case 'u':
+            KEYWORD("union", TOK_UNION);
+            KEYWORD("unsigned", TOK_UNSIGNED);
+            break;
+        case 'v':
+            KEYWORD("void", TOK_VOID);
+            KEYWORD("volatile", TOK_VOLATILE);
+            break;
+        case 'w':
+            KEYWORD("while", TOK_WHILE);
+            break;
+    }
+    return -1;
+}
+
+#undef KEYWORD
+
+int get_toktype_from_string(char *string, int length) {
+    if(length == 0) {
+        return -1;
+    }
+    if(is_identifier_char(string[0])) {
+        return get_keyword_type(string, length);
+    }
+    int type;
+    if(match_operator(string, length, &type) == length) {
+        return type;
     }
     return -1;
 }
 
 char *get_string_from_toktype(int value) {
-    int i;
-    for(i = 0; i < sizeof(convert_table) / sizeof(convert_table[0]); i++) {
-        if(convert_table[i].value == value) {
-            return convert_table[i].string;
-        }
+    if(value < 0 || (value & 0xFFF) >= TOKEN_NAME_GROUP_SIZE || TOKEN_NAME_INDEX(value) >= TOKEN_NAME_TABLE_SIZE) {
+        return "(unknown)";
     }
-    return "(unknown)";
+    char *name = token_names[TOKEN_NAME_INDEX(value)];
+    return name != NULL ? name : "(unknown)";
 }
 
 char token_to_string_output[256];
@@ -613,25 +2547,12 @@ char *token_to_string(token *tok) {
         snprintf(token_to_string_output, sizeof(token_to_string_output), "'%c'", tok->value);
         return token_to_string_output;
     }
-    int i;
-    for(i = 0; i < sizeof(convert_table) / sizeof(convert_table[0]); i++) {
-        if(tok->type == convert_table[i].value && convert_table[i].string != NULL) {
-            return convert_table[i].string;
-        }
-    }
+    return get_string_from_toktype(tok->type);
 }
 
 void print_token(token *tok) {
     printf("TOKEN: %s\n", token_to_string(tok));
-    if(tok->line_offset != -1) {
-        char *line = string_builder_get(&current_tokenizer->current_line);
-        int pos = tok->line_offset - 1;
-        int len = tok->length;
-        printf("%.*s", pos, line);
-        printf("\x1b[92;1m%.*s\x1b[0m", tok->length, line + pos);
-        printf("%.*s\n", current_tokenizer->current_line.length - (pos + len), line + pos + len);
-        printf("\x1b[92;1m%*s^\x1b[0m\n", tok->line_offset - 1, "");
-    }
+    print_token_source(tok, "92;1");
 }
 
 int is_operator(int type) {
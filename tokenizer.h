@@ -1,8 +1,39 @@
 #ifndef TOKENIZER_H
 #define TOKENIZER_H
 
+#include <stdio.h>
+
 #include "datastructs.h"
 
+// regular files are mapped into memory, everything else (stdin, pipes) is
+// read into a buffer in chunks of this size
+#if defined(__unix__) || defined(__APPLE__)
+    #define TOKENIZER_USE_MMAP 1
+#else
+    #define TOKENIZER_USE_MMAP 0
+#endif
+#define TOKENIZER_READ_CHUNK 65536
+
+// files are told apart by device and inode, so a header reached through
+// two different paths is still only included once
+#if defined(__unix__) || defined(__APPLE__)
+    #define TOKENIZER_USE_FILE_IDS 1
+#else
+    #define TOKENIZER_USE_FILE_IDS 0
+#endif
+
+// files can be lexed on several threads at once, split into chunks of at
+// least this many bytes
+#if defined(__unix__) || defined(__APPLE__)
+    #define TOKENIZER_USE_THREADS 1
+#else
+    #define TOKENIZER_USE_THREADS 0
+#endif
+#define TOKENIZER_PARALLEL_MIN_CHUNK 65536
+
+// how many tokens the parser can look ahead, must be a power of 2
+#define TOKENIZER_LOOKAHEAD 16
+
 enum {
     TOK_EOF = 0x0000,
     TOK_ERROR,
@@ -120,50 +151,183 @@ enum {
     TOK_IDENTIFIER = 0x6000
 };
 
+typedef struct source_file source_file;
+
+// the whole contents of an input file, kept alive until end_tokenizer() so
+// tokens can refer straight into it
+struct source_file {
+    int id;
+    char *filename;
+    char *buffer;
+    int length;
+    int mapped;
+    
+    // offset of the start of every line, built the first time a line
+    // number is asked for
+    int *line_starts;
+    int line_count;
+    
+    // both 0 when the file can't be identified
+    unsigned long long device;
+    unsigned long long inode;
+    
+    // set by #pragma once, and the name of the include guard when
+    // everything in the file is inside one
+    int once;
+    char *guard;
+    
+    // every token of the file, directives included, recorded the first
+    // time it's included so including it again doesn't lex it again
+    struct token **cache;
+    int cache_count;
+    int cache_state;
+};
+
+// a token as the lexer first finds it, before its text is interned and it
+// is added to the token stream
+typedef struct raw_token {
+    int type;
+    // the number for constants, the hash for identifiers and strings
+    int value;
+    int offset;
+    int length;
+} raw_token;
+
 typedef struct tokenizer tokenizer;
 
 struct tokenizer {
     tokenizer *parent;
     
-    FILE *file;
+    source_file *source;
     char *filename;
-    int line_num;
-    int line_offset;
-    string_builder current_line;
+    int offset;
     token *output;
-    string_builder tok;
-    int type;
-    int ptype;
-    char c;
-    char ending_char;
-    int peeked;
-    int newline_found;
+    
+    // tokens lexed ahead of time by tokenizer_lex_parallel(), replayed
+    // instead of lexing the buffer again for as long as they're known to
+    // match it
+    raw_token *raw;
+    int raw_count;
+    int raw_index;
+    int replaying;
+    
+    // reading the file's cached tokens, or adding to them
+    int from_cache;
+    int cache_index;
+    int recording;
+    // lexing a region that was skipped when the cache was recorded, up to
+    // here, before going back to the cache
+    int limit;
+    
+    // how far into the include guard pattern the file is
+    int guard_state;
+    char *guard_name;
+    
+    // the #if, #ifdef and #ifndef blocks the file is in, innermost last,
+    // each set once it's had its #else. Inactive branches are skipped
+    // without being lexed, so every block on it is in an active branch.
+    int *conditionals;
+    int conditional_count;
 };
 
 typedef struct token {
     int type;
-    char *string;
     int value;
-    int prefix_postfix;
+    // interned, for identifiers and string constants
+    char *string;
     
-    // for error printing
-    int line_offset;
+    // span in the source file, line and column are worked out from it
+    // only when they're needed
+    int file;
+    int offset;
     int length;
 } token;
 
+// a #define, its body is lexed once and the same tokens are replayed
+// every time it's expanded
+typedef struct macro {
+    char *name;
+    int defined;
+    int function_like;
+    char **parameters;
+    int parameter_count;
+    token **body;
+    int body_length;
+    // set while its expansion is being read, so it can't expand itself
+    int expanding;
+} macro;
+
+// open addressing on the interned name, entries stay in the table after
+// #undef so they can be defined again
+#define MACRO_TABLE_START_SIZE 256
+
+extern macro **macro_table;
+extern int macro_table_size;
+
+macro *macro_find(char *name);
+macro *macro_define(char *name);
+
+// tokens are stored in blocks that never move once allocated, so pointers
+// to them stay valid while the stream grows, and are numbered in the order
+// they were lexed
+#define TOKEN_BLOCK_BITS 12
+#define TOKEN_BLOCK_SIZE (1 << TOKEN_BLOCK_BITS)
+
+typedef struct token_stream {
+    token **blocks;
+    int block_count;
+    int length;
+} token_stream;
+
+extern token_stream tokens;
+
+// indexed by source_file->id
+extern int source_file_count;
+
+// files are lexed on this many threads, 1 lexes them serially, in chunks
+// of at least tokenizer_min_chunk bytes
+extern int tokenizer_threads;
+extern int tokenizer_min_chunk;
+
+// with tokenizer_pipeline set the lexer runs on a thread of its own ahead
+// of the parser, handing it tokens through a ring of this many entries, a
+// power of 2, in batches of TOKENIZER_PIPELINE_BATCH
+#define TOKENIZER_PIPELINE_SIZE 4096
+#define TOKENIZER_PIPELINE_BATCH 64
+extern int tokenizer_pipeline;
+
 void init_tokenizer();
 void end_tokenizer();
 tokenizer *tokenizer_create(tokenizer *parent, FILE *in, char *filename_in);
+tokenizer *tokenizer_start(tokenizer *parent, source_file *source, char *filename_in);
 void tokenizer_delete(tokenizer *reader);
-token *tokenizer_get_f(tokenizer *reader);
-token *tokenizer_peek_f(tokenizer *reader);
+source_file *source_file_read(FILE *in, char *filename);
+source_file *source_file_load(FILE *in, char *filename);
+void source_file_delete(source_file *source);
+source_file *source_file_get(int id);
+// every file that was read, as a make rule for target, with an empty rule
+// for each one but the input as well when phony is set
+void write_dependencies(char *filename, char *target, source_file *input, int phony);
+void tokenizer_lex_parallel(tokenizer *reader, int threads);
 token *tokenizer_get();
 token *tokenizer_peek();
+token *tokenizer_peek_n(int n);
+token *tokenizer_last();
+// the parser is given tokens it's already had again, up to
+// tokenizer_replay_end() when it goes back to where it was in the input.
+// There has to be at least one.
+void tokenizer_replay(token **tokens, int count);
+void tokenizer_replay_end();
 
-void delete_token(token *t);
+token *create_token(int type);
+token *token_stream_get(token_stream *stream, int index);
+char *token_start(token *tok);
+char *token_filename(token *tok);
+void token_position(token *tok, int *line, int *column);
+void print_token_source(token *tok, char *color);
 char *get_string_from_toktype(int type);
 void free_tokens();
-int get_toktype_from_string();
+int get_toktype_from_string(char *string, int length);
 char *token_to_string(token *tok);
 void print_token(token *tok);
 